@@ -0,0 +1,229 @@
+/*
+ * Measures event pattern matching: registers a mix of exact, prefix and
+ * glob patterns spread over a number of subscriber objects and times the
+ * dispatch of a set of event ids through ubusd_send_event. All patterns
+ * belong to the sending client, so every match stops at the loopback check
+ * and only the lookup itself is measured. With -l the same ids are matched
+ * by testing every pattern in turn, as a linear scan would.
+ */
+
+#include <time.h>
+#include <unistd.h>
+
+#include "ubusd_event.c"
+
+struct uloop uloop;
+struct blob_buf b;
+
+void ubusd_obj_init(void);
+void ubusd_proto_init(void);
+
+static struct blob_buf bench_buf;
+static struct ubusd_client bench_client;
+static struct event_source **sources;
+static int n_sources;
+static volatile unsigned long bench_sink;
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* roughly what a router has: interfaces, wifi stations and services */
+static void bench_pattern(char *buf, size_t len, int i)
+{
+	int n = i / 10;
+
+	switch (i % 10) {
+	case 0:
+	case 1:
+		snprintf(buf, len, "network.interface.lan%d.up", n);
+		break;
+	case 2:
+	case 3:
+		snprintf(buf, len, "hostapd.wlan%d.sta-assoc", n);
+		break;
+	case 4:
+	case 5:
+		snprintf(buf, len, "service.svc%d.state", n);
+		break;
+	case 6:
+		snprintf(buf, len, "network.interface.lan%d.*", n);
+		break;
+	case 7:
+		snprintf(buf, len, "service.svc%d*", n);
+		break;
+	case 8:
+		snprintf(buf, len, "hostapd.*.sta-%d", n);
+		break;
+	default:
+		snprintf(buf, len, "network.**.link%d", n);
+		break;
+	}
+}
+
+static void bench_event_id(char *buf, size_t len, int i, int range)
+{
+	int n = rand() % range;
+
+	switch (i % 5) {
+	case 0:
+		snprintf(buf, len, "network.interface.lan%d.up", n);
+		break;
+	case 1:
+		snprintf(buf, len, "hostapd.wlan%d.sta-assoc", n);
+		break;
+	case 2:
+		snprintf(buf, len, "service.svc%d.state", n);
+		break;
+	case 3:
+		snprintf(buf, len, "network.device.eth%d.link%d", n % 8, n);
+		break;
+	default:
+		snprintf(buf, len, "system.ntp.sync%d", n);
+		break;
+	}
+}
+
+static bool bench_register(struct ubusd_object *obj, const char *pattern)
+{
+	struct blob_attr *msg;
+	blob_offset_t tbl;
+
+	blob_buf_reset(&bench_buf);
+	tbl = blob_buf_open_table(&bench_buf);
+	blob_buf_put_string(&bench_buf, "pattern");
+	blob_buf_put_string(&bench_buf, pattern);
+	blob_buf_put_string(&bench_buf, "object");
+	blob_buf_put_u32(&bench_buf, obj->id.id);
+	blob_buf_close_table(&bench_buf, tbl);
+
+	msg = blob_attr_first_child(blob_buf_head(&bench_buf));
+	if (ubusd_alloc_event_pattern(&bench_client, msg))
+		return false;
+
+	sources[n_sources++] = list_first_entry(&obj->events, struct event_source, list);
+	return true;
+}
+
+static int usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [<options>]\n"
+		"Options: \n"
+		"  -p <count>:		Number of patterns (default: 10000)\n"
+		"  -o <count>:		Patterns per subscriber object (default: 10)\n"
+		"  -e <count>:		Number of distinct event ids (default: 1000)\n"
+		"  -i <rounds>:		Number of rounds over all event ids (default: 100)\n"
+		"  -l:			Match by testing every pattern in turn\n"
+		"\n", progname);
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	struct ubusd_object *obj = NULL;
+	struct blob_attr *data;
+	blob_offset_t tbl;
+	int n_patterns = 10000, per_obj = 10, n_ids = 1000, rounds = 100;
+	bool linear = false;
+	unsigned long matches = 0;
+	double start, elapsed;
+	char **ids, buf[64];
+	int i, r, ch;
+
+	while ((ch = getopt(argc, argv, "p:o:e:i:l")) != -1) {
+		switch (ch) {
+		case 'p':
+			n_patterns = atoi(optarg);
+			break;
+		case 'o':
+			per_obj = atoi(optarg);
+			break;
+		case 'e':
+			n_ids = atoi(optarg);
+			break;
+		case 'i':
+			rounds = atoi(optarg);
+			break;
+		case 'l':
+			linear = true;
+			break;
+		default:
+			return usage(argv[0]);
+		}
+	}
+
+	if (n_patterns <= 0 || per_obj <= 0 || n_ids <= 0 || rounds <= 0)
+		return usage(argv[0]);
+
+	blob_buf_init(&b, 0, 0);
+	blob_buf_init(&bench_buf, 0, 0);
+	ubusd_obj_init();
+	ubusd_proto_init();
+
+	if (!ubusd_alloc_id(&clients, &bench_client.id, 0))
+		return 1;
+
+	sources = calloc(n_patterns, sizeof(*sources));
+	ids = calloc(n_ids, sizeof(*ids));
+	if (!sources || !ids)
+		return 1;
+
+	for (i = 0; i < n_patterns; i++) {
+		if (!(i % per_obj)) {
+			obj = ubusd_create_object_internal(NULL, 0);
+			if (!obj)
+				return 1;
+
+			obj->client = &bench_client;
+		}
+
+		bench_pattern(buf, sizeof(buf), i);
+		if (!bench_register(obj, buf)) {
+			fprintf(stderr, "failed to register %s\n", buf);
+			return 1;
+		}
+	}
+
+	srand(1);
+	for (i = 0; i < n_ids; i++) {
+		bench_event_id(buf, sizeof(buf), i, n_patterns / 10 + 1);
+		ids[i] = strdup(buf);
+	}
+
+	blob_buf_reset(&bench_buf);
+	tbl = blob_buf_open_table(&bench_buf);
+	blob_buf_close_table(&bench_buf, tbl);
+	data = blob_attr_first_child(blob_buf_head(&bench_buf));
+
+	for (i = 0; i < n_ids; i++) {
+		for (r = 0; r < n_sources; r++)
+			matches += event_source_match(sources[r], ids[i]);
+	}
+
+	start = bench_now();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < n_ids; i++) {
+			if (linear) {
+				int j;
+
+				for (j = 0; j < n_sources; j++)
+					bench_sink += event_source_match(sources[j], ids[i]);
+			} else {
+				ubusd_send_event(&bench_client, ids[i], data, false);
+			}
+		}
+	}
+	elapsed = bench_now() - start;
+
+	printf("%s: %d patterns, %d ids x %d rounds in %.3f s, %.1f ns per event, "
+	       "%.2f matches per event\n",
+	       linear ? "linear" : "trie", n_patterns, n_ids, rounds, elapsed,
+	       elapsed * 1e9 / ((double) n_ids * rounds),
+	       (double) matches / n_ids);
+
+	return 0;
+}
@@ -0,0 +1,147 @@
+/*
+ * Measures the ID allocator under registration churn: a batch of IDs is
+ * allocated, as when a service registers its objects on restart, and freed
+ * again. Runs against the slot allocator, the random allocator (-r) and, for
+ * comparison, the previous scheme of one /dev/urandom read per ID (-u).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <libubus2/libubus2.h>
+
+#include "ubusd_id.h"
+
+static int random_fd = -1;
+
+static int bench_cmp_id(const void *k1, const void *k2, void *ptr)
+{
+	const uint32_t *id1 = k1, *id2 = k2;
+
+	if (*id1 < *id2)
+		return -1;
+	else
+		return *id1 > *id2;
+}
+
+/* the allocator as it was before the random pool */
+static bool bench_alloc_urandom(struct avl_tree *tree, struct ubusd_id *id)
+{
+	id->avl.key = &id->id;
+	do {
+		if (read(random_fd, &id->id, sizeof(id->id)) != sizeof(id->id))
+			return false;
+
+		if (id->id < UBUS_SYSTEM_OBJECT_MAX)
+			continue;
+	} while (avl_insert(tree, &id->avl) != 0);
+
+	return true;
+}
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [<options>]\n"
+		"Options: \n"
+		"  -n <count>:		IDs allocated per round (default: 1000)\n"
+		"  -i <rounds>:		Number of rounds (default: 1000)\n"
+		"  -r:			Use fully random IDs\n"
+		"  -u:			Use one /dev/urandom read per ID, as before\n"
+		"\n", progname);
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	struct ubusd_id_map map;
+	struct avl_tree tree;
+	struct ubusd_id *ids;
+	bool urandom = false;
+	int count = 1000, rounds = 1000;
+	const char *mode = "slot";
+	double start, elapsed;
+	int i, r, ch;
+
+	while ((ch = getopt(argc, argv, "n:i:ru")) != -1) {
+		switch (ch) {
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'i':
+			rounds = atoi(optarg);
+			break;
+		case 'r':
+			ubusd_id_random = true;
+			mode = "random";
+			break;
+		case 'u':
+			urandom = true;
+			mode = "urandom";
+			break;
+		default:
+			return usage(argv[0]);
+		}
+	}
+
+	if (count <= 0 || rounds <= 0)
+		return usage(argv[0]);
+
+	ids = calloc(count, sizeof(*ids));
+	if (!ids)
+		return 1;
+
+	if (urandom) {
+		random_fd = open("/dev/urandom", O_RDONLY);
+		if (random_fd < 0) {
+			perror("open");
+			return 1;
+		}
+
+		avl_init(&tree, bench_cmp_id, false, NULL);
+	} else {
+		ubusd_init_id_map(&map);
+	}
+
+	start = bench_now();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < count; i++) {
+			bool ok;
+
+			if (urandom)
+				ok = bench_alloc_urandom(&tree, &ids[i]);
+			else
+				ok = ubusd_alloc_id(&map, &ids[i], 0);
+
+			if (!ok) {
+				fprintf(stderr, "allocation %d failed\n", i);
+				return 1;
+			}
+		}
+
+		for (i = 0; i < count; i++) {
+			if (urandom)
+				avl_delete(&tree, &ids[i].avl);
+			else
+				ubusd_free_id(&map, &ids[i]);
+		}
+	}
+	elapsed = bench_now() - start;
+
+	printf("%s: %d IDs x %d rounds in %.3f s, %.1f ns per ID, %.0f IDs/s\n",
+	       mode, count, rounds, elapsed,
+	       elapsed * 1e9 / ((double) count * rounds),
+	       (double) count * rounds / elapsed);
+
+	free(ids);
+	return 0;
+}
@@ -19,6 +19,7 @@
 #endif
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 
@@ -29,7 +30,7 @@
 
 #include "ubusd.h"
 
-static struct uloop uloop; 
+struct uloop uloop;
 struct blob_buf b; 
 
 static bool get_next_connection(int fd)
@@ -75,7 +76,10 @@ static int usage(const char *progname)
 	fprintf(stderr, "Usage: %s [<options>]\n"
 		"Options: \n"
 		"  -s <socket>:		Set the unix domain socket to listen on\n"
-		"\n", progname);
+		"  -q <bytes>:		Limit the transmit queue of each client (default: %d)\n"
+		"  -p <policy>:		Slow client policy: block, drop or disconnect (default: block)\n"
+		"  -r:			Allocate fully random object and client IDs\n"
+		"\n", progname, UBUSD_CLIENT_TXQ_LIMIT);
 	return 1;
 }
 
@@ -86,6 +90,7 @@ int main(int argc, char **argv)
 {
 	const char *ubusd_socket = UBUS_UNIX_SOCKET;
 	int ret = 0;
+	int policy;
 	int ch;
 	
 	blob_buf_init(&b, 0, 0); 
@@ -99,11 +104,25 @@ int main(int argc, char **argv)
 
 	uloop_init(&uloop);
 
-	while ((ch = getopt(argc, argv, "s:")) != -1) {
+	while ((ch = getopt(argc, argv, "s:q:p:r")) != -1) {
 		switch (ch) {
 		case 's':
 			ubusd_socket = optarg;
 			break;
+		case 'q':
+			ubusd_client_txq_limit = atoi(optarg);
+			if (!ubusd_client_txq_limit)
+				return usage(argv[0]);
+			break;
+		case 'p':
+			policy = ubusd_txq_policy_from_string(optarg);
+			if (policy < 0)
+				return usage(argv[0]);
+			ubusd_client_txq_policy = policy;
+			break;
+		case 'r':
+			ubusd_id_random = true;
+			break;
 		default:
 			return usage(argv[0]);
 		}
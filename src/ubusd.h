@@ -23,30 +23,50 @@
 #include "ubusd_obj.h"
 
 #define UBUSD_CLIENT_BACKLOG	32
+#define UBUSD_CLIENT_RX_BUFSIZE	16384
+#define UBUSD_CLIENT_TXQ_LIMIT	(1024 * 1024)
+#define UBUSD_CLIENT_TXQ_HARD_FACTOR	4 /* times txq_limit, for the block policy */
+#define UBUSD_MSG_POOL_LIMIT	(256 * 1024)
+#define UBUSD_LOOKUP_FRAME_SIZE	(32 * 1024)
+#define UBUSD_EVENT_RETAIN_MAX	256
+#define UBUSD_EVENT_RETAIN_BYTES	(64 * 1024)
+#define UBUSD_EVENT_BATCH_SIZE	(16 * 1024)
+#define UBUSD_REQUEST_TICK	100 /* ms */
+#define UBUSD_REQUEST_WHEEL_SIZE	256
+#define UBUSD_REQUEST_TIMEOUT	(60 * 1000) /* ms, for invokes without a deadline */
+#define UBUSD_CLIENT_MAX_REQUESTS	1024 /* tracked invokes per caller */
 #define UBUS_OBJ_HASH_BITS	4
 
-extern struct blob_buf b;
+#define UBUSD_SYSTEM_OBJECT_DAEMON	(UBUS_SYSTEM_OBJECT_MAX - 1)
 
-struct ubusd_path {
-	struct list_head list;
-	const char name[];
-};
+extern struct uloop uloop;
+extern struct blob_buf b;
 
+#include "ubusd_path.h"
 #include "ubusd_client.h"
 #include "ubusd_msg.h"
 #include "ubusd_socket.h"
+#include "ubusd_request.h"
 
 struct ubusd_msg_buf *ubusd_msg_new(void *data, int len, bool shared);
 void ubusd_msg_send(struct ubusd_client *cl, struct ubusd_msg_buf *ub, bool free);
 void ubusd_msg_free(struct ubusd_msg_buf *ub);
 
 struct ubusd_client *ubusd_proto_new_client(int fd);
+void ubusd_send_msg_from_blob(struct ubusd_client *cl, struct ubusd_msg_buf *ub, uint8_t type);
+void ubusd_put_obj(struct blob_buf *buf, struct ubusd_object *obj);
 void ubusd_proto_receive_message(struct ubusd_client *cl, struct ubusd_msg_buf *ub);
+int ubusd_proto_dispatch(struct ubusd_client *cl, struct ubusd_msg_buf *ub,
+			 struct blob_attr **attr);
 void ubusd_proto_free_client(struct ubusd_client *cl);
 
 void ubusd_event_init(void);
 void ubusd_event_cleanup_object(struct ubusd_object *obj);
+void ubusd_event_cleanup_client(struct ubusd_client *cl);
 void ubusd_send_obj_event(struct ubusd_object *obj, bool add);
 
+void ubusd_daemon_init(void);
+void ubusd_daemon_cleanup_client(struct ubusd_client *cl);
+
 
 #endif
@@ -11,6 +11,26 @@
 
 #include "ubusd.h"
 
+unsigned int ubusd_client_txq_limit = UBUSD_CLIENT_TXQ_LIMIT;
+enum ubusd_txq_policy ubusd_client_txq_policy = UBUSD_TXQ_BLOCK;
+
+const char * const ubusd_txq_policy_names[] = {
+	[UBUSD_TXQ_BLOCK] = "block",
+	[UBUSD_TXQ_DROP_EVENTS] = "drop",
+	[UBUSD_TXQ_DISCONNECT] = "disconnect",
+};
+
+int ubusd_txq_policy_from_string(const char *name){
+	int i;
+
+	for (i = 0; i < __UBUSD_TXQ_POLICY_LAST; i++) {
+		if (!strcmp(name, ubusd_txq_policy_names[i]))
+			return i;
+	}
+
+	return -1;
+}
+
 struct ubusd_client *ubusd_client_new(int fd){
 	struct ubusd_client *self = malloc(sizeof(struct ubusd_client)); 
 	ubusd_client_init(self, fd); 
@@ -41,10 +61,14 @@ static void _handle_message(struct ubusd_client *cl, struct ubusd_msg_buf *ub){
 void ubusd_client_init(struct ubusd_client *self, int fd){
 	memset(self, 0, sizeof(struct ubusd_client)); 
 	INIT_LIST_HEAD(&self->objects);
+	INIT_LIST_HEAD(&self->requests);
+	INIT_LIST_HEAD(&self->pending);
 	ubusd_socket_init(self, fd); 
 	ubusd_socket_on_disconnect(self, _handle_client_disconnect); 
 	ubusd_socket_on_message(self, _handle_message); 
 	self->pending_msg_fd = -1;
+	self->txq_limit = ubusd_client_txq_limit;
+	self->txq_policy = ubusd_client_txq_policy;
 	uloop_init(&self->uloop); 
 }
 
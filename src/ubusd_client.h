@@ -0,0 +1,64 @@
+#ifndef __UBUSD_CLIENT_H
+#define __UBUSD_CLIENT_H
+
+#include <libusys/uloop.h>
+#include <libubus2/libubus2.h>
+
+#include "ubusd_id.h"
+
+struct ubusd_msg_buf;
+
+/* what to do when a client does not read its messages fast enough */
+enum ubusd_txq_policy {
+	UBUSD_TXQ_BLOCK,	/* stop reading requests from the client, drop
+				 * events and disconnect on other messages
+				 * pushed by others past a hard limit */
+	UBUSD_TXQ_DROP_EVENTS,	/* drop the oldest queued events */
+	UBUSD_TXQ_DISCONNECT,	/* drop the client */
+	__UBUSD_TXQ_POLICY_LAST
+};
+
+extern struct ubusd_id_map clients;
+
+extern unsigned int ubusd_client_txq_limit;
+extern enum ubusd_txq_policy ubusd_client_txq_policy;
+extern const char * const ubusd_txq_policy_names[];
+
+struct ubusd_client {
+	struct ubusd_id id;
+	struct uloop_fd sock;
+	struct uloop uloop;
+
+	struct list_head objects;
+
+	/* forwarded invokes this client made and the ones it has to answer */
+	struct list_head requests, pending;
+	unsigned int n_requests;
+
+	/* ring of queued messages, grows as needed and is bounded by
+	 * txq_limit bytes according to txq_policy */
+	struct ubusd_msg_buf **tx_queue;
+	unsigned int txq_size, txq_cur, txq_tail, txq_ofs;
+	unsigned int txq_bytes, txq_limit;
+	enum ubusd_txq_policy txq_policy;
+
+	unsigned int txq_high_water;
+	unsigned int txq_dropped;
+
+	/* received bytes, complete frames are parsed in place */
+	char *rx_buf;
+	unsigned int rx_size, rx_ofs, rx_len;
+
+	int pending_msg_fd;
+	unsigned int pending_msg_fd_ofs;
+
+	void (*on_message)(struct ubusd_client *self, struct ubusd_msg_buf *ub);
+	void (*on_disconnected)(struct ubusd_client *self);
+};
+
+struct ubusd_client *ubusd_client_new(int fd);
+void ubusd_client_delete(struct ubusd_client **self);
+void ubusd_client_init(struct ubusd_client *self, int fd);
+int ubusd_txq_policy_from_string(const char *name);
+
+#endif
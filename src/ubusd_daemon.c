@@ -0,0 +1,679 @@
+/*
+ * The daemon object gives clients access to their own connection settings,
+ * to the daemon statistics and to batched registry operations.
+ */
+
+#include "ubusd.h"
+
+static struct ubusd_object *daemon_obj;
+static struct blob_buf batch_buf;
+
+enum {
+	CONFIG_TX_LIMIT,
+	CONFIG_TX_POLICY,
+	CONFIG_LAST,
+};
+
+static struct blob_attr_policy config_policy[] = {
+	[CONFIG_TX_LIMIT] = { .name = "tx_limit", .type = BLOB_ATTR_INT32 },
+	[CONFIG_TX_POLICY] = { .name = "tx_policy", .type = BLOB_ATTR_STRING },
+};
+
+static int ubusd_daemon_config(struct ubusd_client *cl, struct blob_attr *msg)
+{
+	struct blob_attr *attr[CONFIG_LAST];
+	int policy = cl->txq_policy;
+
+	if (!msg)
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	blob_attr_parse(msg, attr, config_policy, CONFIG_LAST);
+
+	if (attr[CONFIG_TX_POLICY]) {
+		policy = ubusd_txq_policy_from_string(blob_attr_data(attr[CONFIG_TX_POLICY]));
+		if (policy < 0)
+			return UBUS_STATUS_INVALID_ARGUMENT;
+	}
+
+	if (attr[CONFIG_TX_LIMIT]) {
+		if (!blob_attr_get_u32(attr[CONFIG_TX_LIMIT]))
+			return UBUS_STATUS_INVALID_ARGUMENT;
+
+		cl->txq_limit = blob_attr_get_u32(attr[CONFIG_TX_LIMIT]);
+	}
+
+	cl->txq_policy = policy;
+	return 0;
+}
+
+static int ubusd_daemon_stats(struct ubusd_client *cl, struct ubusd_msg_buf *ub)
+{
+	struct ubusd_client *c;
+	blob_offset_t tbl, arr, s;
+
+	blob_buf_reset(&b);
+	blob_buf_put_i32(&b, daemon_obj->id.id);
+
+	tbl = blob_buf_open_table(&b);
+	blob_buf_put_string(&b, "clients");
+	arr = blob_buf_open_array(&b);
+	ubusd_id_map_for_each_element(&clients, c, id) {
+		s = blob_buf_open_table(&b);
+		blob_buf_put_string(&b, "id");
+		blob_buf_put_u32(&b, c->id.id);
+		blob_buf_put_string(&b, "tx_queued");
+		blob_buf_put_u32(&b, c->txq_bytes);
+		blob_buf_put_string(&b, "tx_high_water");
+		blob_buf_put_u32(&b, c->txq_high_water);
+		blob_buf_put_string(&b, "tx_dropped");
+		blob_buf_put_u32(&b, c->txq_dropped);
+		blob_buf_put_string(&b, "tx_limit");
+		blob_buf_put_u32(&b, c->txq_limit);
+		blob_buf_put_string(&b, "tx_policy");
+		blob_buf_put_string(&b, ubusd_txq_policy_names[c->txq_policy]);
+		blob_buf_close_table(&b, s);
+	}
+	blob_buf_close_array(&b, arr);
+
+	blob_buf_put_string(&b, "msg");
+	s = blob_buf_open_table(&b);
+	blob_buf_put_string(&b, "allocs");
+	blob_buf_put_u32(&b, ubusd_msg_stats.allocs);
+	blob_buf_put_string(&b, "pool_hits");
+	blob_buf_put_u32(&b, ubusd_msg_stats.pool_hits);
+	blob_buf_put_string(&b, "frees");
+	blob_buf_put_u32(&b, ubusd_msg_stats.frees);
+	blob_buf_put_string(&b, "pool_bytes");
+	blob_buf_put_u32(&b, ubusd_msg_stats.pool_bytes);
+	blob_buf_close_table(&b, s);
+	blob_buf_close_table(&b, tbl);
+
+	ubusd_send_msg_from_blob(cl, ub, UBUS_MSG_DATA);
+	return 0;
+}
+
+enum {
+	LOOKUP_PATH,
+	LOOKUP_LIMIT,
+	LOOKUP_CURSOR,
+	LOOKUP_LAST,
+};
+
+static struct blob_attr_policy lookup_policy[] = {
+	[LOOKUP_PATH] = { .name = "path", .type = BLOB_ATTR_STRING },
+	[LOOKUP_LIMIT] = { .name = "limit", .type = BLOB_ATTR_INT32 },
+	[LOOKUP_CURSOR] = { .name = "cursor", .type = BLOB_ATTR_STRING },
+};
+
+struct ubusd_lookup_batch {
+	struct ubusd_client *cl;
+	struct ubusd_msg_buf *ub;
+	blob_offset_t tbl, arr;
+	unsigned int limit;
+	unsigned int count;
+	struct ubusd_object *last;
+	bool more;
+};
+
+static void ubusd_lookup_batch_open(struct ubusd_lookup_batch *req)
+{
+	blob_buf_reset(&b);
+	blob_buf_put_i32(&b, daemon_obj->id.id);
+	req->tbl = blob_buf_open_table(&b);
+	blob_buf_put_string(&b, "generation");
+	blob_buf_put_u32(&b, ubusd_registry_gen);
+	blob_buf_put_string(&b, "objects");
+	req->arr = blob_buf_open_array(&b);
+}
+
+static void ubusd_lookup_batch_send(struct ubusd_lookup_batch *req, bool more)
+{
+	blob_buf_close_array(&b, req->arr);
+	if (more) {
+		blob_buf_put_string(&b, "cursor");
+		blob_buf_put_string(&b, ubusd_path_name(req->last->path));
+	}
+	blob_buf_close_table(&b, req->tbl);
+
+	ubusd_send_msg_from_blob(req->cl, req->ub, UBUS_MSG_DATA);
+}
+
+static bool ubusd_lookup_batch_add(struct ubusd_object *obj, void *priv)
+{
+	struct ubusd_lookup_batch *req = priv;
+
+	if (req->limit && req->count == req->limit) {
+		req->more = true;
+		return false;
+	}
+
+	/* start a new frame once the current one is large enough */
+	if (blob_buf_size(&b) >= UBUSD_LOOKUP_FRAME_SIZE) {
+		ubusd_lookup_batch_send(req, false);
+		ubusd_lookup_batch_open(req);
+	}
+
+	ubusd_put_obj(&b, obj);
+	req->last = obj;
+	req->count++;
+	return true;
+}
+
+/*
+ * Sends the descriptors of all matching objects packed into as few DATA
+ * messages as possible. With a limit, the last message carries a cursor
+ * that continues the listing when passed back.
+ */
+static int ubusd_daemon_lookup(struct ubusd_client *cl, struct ubusd_msg_buf *ub, struct blob_attr *msg)
+{
+	struct blob_attr *attr[LOOKUP_LAST] = { NULL };
+	struct ubusd_lookup_batch req = {
+		.cl = cl,
+		.ub = ub,
+	};
+	const char *pattern = "*", *cursor = NULL;
+	int n;
+
+	if (msg)
+		blob_attr_parse(msg, attr, lookup_policy, LOOKUP_LAST);
+
+	if (attr[LOOKUP_PATH])
+		pattern = blob_attr_data(attr[LOOKUP_PATH]);
+	if (attr[LOOKUP_CURSOR])
+		cursor = blob_attr_data(attr[LOOKUP_CURSOR]);
+	if (attr[LOOKUP_LIMIT])
+		req.limit = blob_attr_get_u32(attr[LOOKUP_LIMIT]);
+
+	ubusd_lookup_batch_open(&req);
+	n = ubusd_path_lookup(pattern, cursor, ubusd_lookup_batch_add, &req);
+	if (!n && !cursor)
+		return UBUS_STATUS_NOT_FOUND;
+
+	ubusd_lookup_batch_send(&req, req.more);
+	return 0;
+}
+
+static int ubusd_daemon_generation(struct ubusd_client *cl, struct ubusd_msg_buf *ub)
+{
+	blob_offset_t tbl;
+
+	blob_buf_reset(&b);
+	blob_buf_put_i32(&b, daemon_obj->id.id);
+	tbl = blob_buf_open_table(&b);
+	blob_buf_put_string(&b, "generation");
+	blob_buf_put_u32(&b, ubusd_registry_gen);
+	blob_buf_close_table(&b, tbl);
+
+	ubusd_send_msg_from_blob(cl, ub, UBUS_MSG_DATA);
+	return 0;
+}
+
+enum {
+	BATCH_OPS,
+	BATCH_LAST,
+};
+
+static struct blob_attr_policy batch_policy[] = {
+	[BATCH_OPS] = { .name = "ops", .type = BLOB_ATTR_ARRAY },
+};
+
+enum {
+	BATCH_OP_OP,
+	BATCH_OP_OBJECT,
+	BATCH_OP_PATH,
+	BATCH_OP_METHOD,
+	BATCH_OP_DATA,
+	BATCH_OP_TARGET,
+	BATCH_OP_CURSOR,
+	BATCH_OP_TIMEOUT,
+	BATCH_OP_LAST,
+};
+
+static struct blob_attr_policy batch_op_policy[] = {
+	[BATCH_OP_OP] = { .name = "op", .type = BLOB_ATTR_STRING },
+	[BATCH_OP_OBJECT] = { .name = "object", .type = BLOB_ATTR_INT32 },
+	[BATCH_OP_PATH] = { .name = "path", .type = BLOB_ATTR_STRING },
+	[BATCH_OP_METHOD] = { .name = "method", .type = BLOB_ATTR_STRING },
+	[BATCH_OP_DATA] = { .name = "data", .type = BLOB_ATTR_TABLE },
+	[BATCH_OP_TARGET] = { .name = "target", .type = BLOB_ATTR_INT32 },
+	[BATCH_OP_CURSOR] = { .name = "cursor", .type = BLOB_ATTR_STRING },
+	[BATCH_OP_TIMEOUT] = { .name = "timeout", .type = BLOB_ATTR_INT32 },
+};
+
+struct ubusd_batch;
+
+/* the result of an operation is kept until all of them are done */
+struct ubusd_batch_op {
+	struct ubusd_batch *batch;
+	struct blob_attr *result; /* fields of the result besides the status */
+	struct blob_attr **data; /* responses of a forwarded invoke */
+	int n_data;
+	int status;
+	int seq; /* of a forwarded invoke still waiting for its status, or -1 */
+};
+
+struct ubusd_batch {
+	struct list_head list;
+	struct ubusd_client *cl;
+	uint16_t seq;
+	uint32_t peer;
+	int n_pending;
+	bool running;
+
+	blob_offset_t tbl, arr;
+	struct ubusd_object *last;
+	bool full;
+
+	int n_ops;
+	struct ubusd_batch_op ops[];
+};
+
+static LIST_HEAD(batches);
+
+static void ubusd_batch_open(struct ubusd_batch *batch)
+{
+	blob_buf_reset(&batch_buf);
+	blob_buf_put_i32(&batch_buf, daemon_obj->id.id);
+	batch->tbl = blob_buf_open_table(&batch_buf);
+	blob_buf_put_string(&batch_buf, "results");
+	batch->arr = blob_buf_open_array(&batch_buf);
+}
+
+static void ubusd_batch_send(struct ubusd_batch *batch)
+{
+	struct ubusd_msg_buf *ub;
+
+	blob_buf_close_array(&batch_buf, batch->arr);
+	blob_buf_close_table(&batch_buf, batch->tbl);
+
+	ub = ubusd_msg_new(blob_buf_head(&batch_buf), blob_buf_size(&batch_buf), false);
+	if (!ub)
+		return;
+
+	ub->hdr.type = UBUS_MSG_DATA;
+	ub->hdr.seq = batch->seq;
+	ub->hdr.peer = batch->peer;
+	ubusd_msg_send(batch->cl, ub, true);
+}
+
+static void ubusd_batch_send_status(struct ubusd_batch *batch, int status)
+{
+	struct ubusd_msg_buf *ub;
+
+	blob_buf_reset(&batch_buf);
+	blob_buf_put_i32(&batch_buf, status);
+
+	ub = ubusd_msg_new(blob_buf_head(&batch_buf), blob_buf_size(&batch_buf), false);
+	if (!ub)
+		return;
+
+	ub->hdr.type = UBUS_MSG_STATUS;
+	ub->hdr.seq = batch->seq;
+	ub->hdr.peer = batch->peer;
+	ubusd_msg_send(batch->cl, ub, true);
+}
+
+static void ubusd_batch_free(struct ubusd_batch *batch)
+{
+	struct ubusd_batch_op *op;
+	int i, j;
+
+	for (i = 0; i < batch->n_ops; i++) {
+		op = &batch->ops[i];
+		if (op->seq >= 0)
+			ubusd_request_cancel_internal(op->seq);
+
+		for (j = 0; j < op->n_data; j++)
+			free(op->data[j]);
+		free(op->data);
+		free(op->result);
+	}
+
+	list_del(&batch->list);
+	free(batch);
+}
+
+/*
+ * Sends the results of all operations in order, packed into as few DATA
+ * messages as possible, followed by the status of the batch itself.
+ */
+static void ubusd_batch_finish(struct ubusd_batch *batch)
+{
+	struct ubusd_batch_op *op;
+	struct blob_attr *cur;
+	blob_offset_t res, arr;
+	int i, j;
+
+	ubusd_batch_open(batch);
+
+	for (i = 0; i < batch->n_ops; i++) {
+		op = &batch->ops[i];
+
+		if (blob_buf_size(&batch_buf) >= UBUSD_LOOKUP_FRAME_SIZE) {
+			ubusd_batch_send(batch);
+			ubusd_batch_open(batch);
+		}
+
+		res = blob_buf_open_table(&batch_buf);
+
+		if (op->result) {
+			for (cur = blob_attr_first_child(op->result); cur;
+			     cur = blob_attr_next_child(op->result, cur))
+				blob_buf_put_attr(&batch_buf, cur);
+		}
+
+		if (op->n_data) {
+			blob_buf_put_string(&batch_buf, "data");
+			arr = blob_buf_open_array(&batch_buf);
+			for (j = 0; j < op->n_data; j++)
+				blob_buf_put_attr(&batch_buf, op->data[j]);
+			blob_buf_close_array(&batch_buf, arr);
+		}
+
+		blob_buf_put_string(&batch_buf, "status");
+		blob_buf_put_u32(&batch_buf, op->status);
+		blob_buf_close_table(&batch_buf, res);
+	}
+
+	ubusd_batch_send(batch);
+	ubusd_batch_send_status(batch, 0);
+	ubusd_batch_free(batch);
+}
+
+/* collects the responses of an invoke forwarded to a client object */
+static void ubusd_batch_invoke_cb(void *priv, struct blob_attr *data, int status)
+{
+	struct ubusd_batch_op *op = priv;
+	struct ubusd_batch *batch = op->batch;
+	struct blob_attr **list;
+
+	if (data) {
+		list = realloc(op->data, (op->n_data + 1) * sizeof(*list));
+		if (!list)
+			return;
+
+		op->data = list;
+		op->data[op->n_data] = malloc(blob_attr_raw_len(data));
+		if (!op->data[op->n_data])
+			return;
+
+		memcpy(op->data[op->n_data++], data, blob_attr_raw_len(data));
+		return;
+	}
+
+	op->status = status;
+	op->seq = -1;
+	if (!--batch->n_pending && !batch->running)
+		ubusd_batch_finish(batch);
+}
+
+/* lookup results are cut off with a cursor once the frame is full */
+static bool ubusd_batch_lookup_add(struct ubusd_object *obj, void *priv)
+{
+	struct ubusd_batch *batch = priv;
+
+	if (blob_buf_size(&batch_buf) >= UBUSD_LOOKUP_FRAME_SIZE) {
+		batch->full = true;
+		return false;
+	}
+
+	ubusd_put_obj(&batch_buf, obj);
+	batch->last = obj;
+	return true;
+}
+
+static int ubusd_batch_lookup(struct ubusd_batch *batch, struct blob_attr **attr)
+{
+	const char *pattern = "*", *cursor = NULL;
+	blob_offset_t arr;
+	int n;
+
+	if (attr[BATCH_OP_PATH])
+		pattern = blob_attr_data(attr[BATCH_OP_PATH]);
+	if (attr[BATCH_OP_CURSOR])
+		cursor = blob_attr_data(attr[BATCH_OP_CURSOR]);
+
+	batch->full = false;
+	blob_buf_put_string(&batch_buf, "objects");
+	arr = blob_buf_open_array(&batch_buf);
+	n = ubusd_path_lookup(pattern, cursor, ubusd_batch_lookup_add, batch);
+	blob_buf_close_array(&batch_buf, arr);
+
+	if (batch->full) {
+		blob_buf_put_string(&batch_buf, "cursor");
+		blob_buf_put_string(&batch_buf, ubusd_path_name(batch->last->path));
+	}
+
+	return n || cursor ? 0 : UBUS_STATUS_NOT_FOUND;
+}
+
+/*
+ * Runs an operation through the handler of the matching message type. Any
+ * message the handler sends goes out under the sequence number of the batch.
+ */
+static int ubusd_batch_dispatch(struct ubusd_batch *batch, int type,
+				struct blob_attr **attr)
+{
+	struct blob_attr *msg_attr[UBUS_ATTR_MAX] = { NULL };
+	struct ubusd_msg_buf *ub;
+	int ret;
+
+	msg_attr[UBUS_ATTR_OBJID] = attr[BATCH_OP_OBJECT];
+	msg_attr[UBUS_ATTR_OBJPATH] = attr[BATCH_OP_PATH];
+	msg_attr[UBUS_ATTR_METHOD] = attr[BATCH_OP_METHOD];
+	msg_attr[UBUS_ATTR_DATA] = attr[BATCH_OP_DATA];
+	msg_attr[UBUS_ATTR_TARGET] = attr[BATCH_OP_TARGET];
+
+	ub = ubusd_msg_new(NULL, 0, false);
+	if (!ub)
+		return UBUS_STATUS_NO_DATA;
+
+	ub->hdr.type = type;
+	ub->hdr.seq = batch->seq;
+	ub->hdr.peer = batch->peer;
+
+	ret = ubusd_proto_dispatch(batch->cl, ub, msg_attr);
+	if (ret == -1)
+		return 0;
+
+	ubusd_msg_free(ub);
+	return ret;
+}
+
+/*
+ * Objects of the daemon are invoked right away. Invokes of client objects
+ * are forwarded with the daemon object as the peer and a sequence number
+ * of the daemon, so that they cannot collide with the requests of the
+ * client, and their responses are collected into the result of the op.
+ */
+static int ubusd_batch_invoke(struct ubusd_batch_op *op, struct blob_attr **attr)
+{
+	struct ubusd_batch *batch = op->batch;
+	struct ubusd_object *obj = NULL;
+	struct ubusd_msg_buf *ub;
+	const char *method;
+	int timeout = 0, seq;
+
+	if (!attr[BATCH_OP_METHOD] || (!attr[BATCH_OP_OBJECT] && !attr[BATCH_OP_PATH]))
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	if (attr[BATCH_OP_PATH])
+		obj = ubusd_path_find(blob_attr_data(attr[BATCH_OP_PATH]));
+	else
+		obj = ubusd_find_object(blob_attr_get_u32(attr[BATCH_OP_OBJECT]));
+
+	if (!obj)
+		return UBUS_STATUS_NOT_FOUND;
+
+	if (!obj->client)
+		return ubusd_batch_dispatch(batch, UBUS_MSG_INVOKE, attr);
+
+	method = blob_attr_data(attr[BATCH_OP_METHOD]);
+	if (obj->type && !ubusd_find_method(obj->type, method))
+		return UBUS_STATUS_METHOD_NOT_FOUND;
+
+	if (attr[BATCH_OP_TIMEOUT])
+		timeout = blob_attr_get_i32(attr[BATCH_OP_TIMEOUT]);
+
+	blob_buf_reset(&b);
+	blob_buf_put_i32(&b, obj->id.id);
+	blob_buf_put_string(&b, method);
+	if (attr[BATCH_OP_DATA])
+		blob_buf_put_attr(&b, attr[BATCH_OP_DATA]);
+
+	ub = ubusd_msg_new(blob_buf_head(&b), blob_buf_size(&b), true);
+	if (!ub)
+		return UBUS_STATUS_NO_DATA;
+
+	seq = ubusd_request_add_internal(obj, timeout, ubusd_batch_invoke_cb, op);
+	if (seq < 0) {
+		ubusd_msg_free(ub);
+		return UBUS_STATUS_UNKNOWN_ERROR;
+	}
+
+	op->seq = seq;
+	batch->n_pending++;
+
+	ub->hdr.type = UBUS_MSG_INVOKE;
+	ub->hdr.seq = seq;
+	ub->hdr.peer = UBUSD_SYSTEM_OBJECT_DAEMON;
+	ubusd_msg_send(obj->client, ub, true);
+
+	return 0;
+}
+
+/*
+ * Runs a list of invoke, lookup, subscribe and unsubscribe operations in
+ * order and sends one result with a status per operation, packed into as
+ * few DATA messages as possible, followed by the status of the batch. The
+ * reply is held until every invoke forwarded to a client object got its
+ * status, the data it sent comes as an array in the result of the op.
+ * A lookup that did not fit into the frame returns a cursor, which
+ * continues the listing when passed back.
+ */
+static int ubusd_daemon_batch(struct ubusd_client *cl, struct ubusd_msg_buf *ub, struct blob_attr *msg)
+{
+	static bool running;
+	struct blob_attr *attr[BATCH_LAST], *op_attr[BATCH_OP_LAST];
+	struct blob_attr *cur, *result;
+	struct ubusd_batch *batch;
+	struct ubusd_batch_op *op;
+	blob_offset_t res;
+	int n = 0;
+
+	if (!msg || running)
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	blob_attr_parse(msg, attr, batch_policy, BATCH_LAST);
+	if (!attr[BATCH_OPS])
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	for (cur = blob_attr_first_child(attr[BATCH_OPS]); cur;
+	     cur = blob_attr_next_child(attr[BATCH_OPS], cur))
+		n++;
+
+	batch = calloc(1, sizeof(*batch) + n * sizeof(*op));
+	if (!batch)
+		return UBUS_STATUS_NO_DATA;
+
+	batch->cl = cl;
+	batch->seq = ub->hdr.seq;
+	batch->peer = ub->hdr.peer;
+	batch->n_ops = n;
+	batch->running = true;
+	list_add_tail(&batch->list, &batches);
+
+	running = true;
+	op = batch->ops;
+
+	for (cur = blob_attr_first_child(attr[BATCH_OPS]); cur;
+	     cur = blob_attr_next_child(attr[BATCH_OPS], cur), op++) {
+		const char *name = NULL;
+		int ret;
+
+		op->batch = batch;
+		op->seq = -1;
+
+		memset(op_attr, 0, sizeof(op_attr));
+		if (blob_attr_type(cur) == BLOB_ATTR_TABLE)
+			blob_attr_parse(cur, op_attr, batch_op_policy, BATCH_OP_LAST);
+		if (op_attr[BATCH_OP_OP])
+			name = blob_attr_data(op_attr[BATCH_OP_OP]);
+
+		/* fields other than the status are kept from batch_buf */
+		blob_buf_reset(&batch_buf);
+		res = blob_buf_open_table(&batch_buf);
+
+		if (!name)
+			ret = UBUS_STATUS_INVALID_ARGUMENT;
+		else if (!strcmp(name, "invoke"))
+			ret = ubusd_batch_invoke(op, op_attr);
+		else if (!strcmp(name, "lookup"))
+			ret = ubusd_batch_lookup(batch, op_attr);
+		else if (!strcmp(name, "subscribe"))
+			ret = ubusd_batch_dispatch(batch, UBUS_MSG_SUBSCRIBE, op_attr);
+		else if (!strcmp(name, "unsubscribe"))
+			ret = ubusd_batch_dispatch(batch, UBUS_MSG_UNSUBSCRIBE, op_attr);
+		else
+			ret = UBUS_STATUS_INVALID_COMMAND;
+
+		blob_buf_close_table(&batch_buf, res);
+		op->status = ret;
+
+		result = blob_attr_first_child(blob_buf_head(&batch_buf));
+		if (blob_attr_len(result)) {
+			op->result = malloc(blob_attr_raw_len(result));
+			if (op->result)
+				memcpy(op->result, result, blob_attr_raw_len(result));
+		}
+	}
+
+	running = false;
+	batch->running = false;
+
+	/* the reply goes out once the last forwarded invoke is done */
+	ubusd_msg_free(ub);
+	if (!batch->n_pending)
+		ubusd_batch_finish(batch);
+
+	return -1;
+}
+
+void ubusd_daemon_cleanup_client(struct ubusd_client *cl)
+{
+	struct ubusd_batch *batch, *tmp;
+
+	list_for_each_entry_safe(batch, tmp, &batches, list) {
+		if (batch->cl == cl)
+			ubusd_batch_free(batch);
+	}
+}
+
+static int ubusd_daemon_recv(struct ubusd_client *cl, struct ubusd_msg_buf *ub,
+			     const char *method, struct blob_attr *msg)
+{
+	if (!strcmp(method, "config"))
+		return ubusd_daemon_config(cl, msg);
+
+	if (!strcmp(method, "stats"))
+		return ubusd_daemon_stats(cl, ub);
+
+	if (!strcmp(method, "lookup"))
+		return ubusd_daemon_lookup(cl, ub, msg);
+
+	if (!strcmp(method, "generation"))
+		return ubusd_daemon_generation(cl, ub);
+
+	if (!strcmp(method, "batch"))
+		return ubusd_daemon_batch(cl, ub, msg);
+
+	return UBUS_STATUS_INVALID_COMMAND;
+}
+
+void ubusd_daemon_init(void)
+{
+	blob_buf_init(&batch_buf, 0, 0);
+	daemon_obj = ubusd_create_object_internal(NULL, UBUSD_SYSTEM_OBJECT_DAEMON);
+	if (daemon_obj != NULL)
+		daemon_obj->recv_msg = ubusd_daemon_recv;
+}
@@ -14,25 +14,471 @@
 #include <arpa/inet.h>
 #include "ubusd.h"
 
-static struct avl_tree patterns;
+/*
+ * Event patterns are kept in a radix trie keyed by the literal part of the
+ * pattern. Exact patterns terminate at the node that spells out the whole
+ * id, patterns with a trailing '*' terminate at the node of their prefix,
+ * so matching an event id only follows the path of that id. Any other
+ * pattern is compiled into a glob that hangs off the node of its literal
+ * prefix and is only run against the rest of ids reaching that node.
+ */
+struct event_node {
+	struct event_node *parent;
+	struct event_node **children; /* sorted by the first label character */
+	int n_children;
+	struct list_head exact;
+	struct list_head partial;
+	struct list_head glob;
+	const char *label;
+	int len;
+};
+
+static struct event_node patterns;
+static struct blob_buf ev_buf;
 static struct ubusd_object *event_obj;
 static int event_seq = 0;
 static int obj_event_seq = 1;
 
 struct event_source {
 	struct list_head list;
+	struct list_head node_list;
+	struct event_node *node;
 	struct ubusd_object *obj;
-	struct avl_node avl;
+	struct event_glob *glob;
+	struct blob_attr *filter;
 	bool partial;
+
+	/* events held back while the delivery interval runs */
+	struct uloop_timeout timer;
+	struct avl_tree pending;
+	int interval;
+};
+
+struct event_pending {
+	struct avl_node avl;
+	struct ubusd_msg_buf *ub;
+	char id[];
+};
+
+/*
+ * The last payload of events sent with the retain flag is kept and handed
+ * to new registrations that ask for a replay. The store is bounded both in
+ * entries and in bytes, the least recently updated id is dropped first, and
+ * the entries of a client go away when it disconnects.
+ */
+struct event_retained {
+	struct avl_node avl;
+	struct list_head list;
+	struct ubusd_msg_buf *ub;
+	uint32_t client; /* publisher */
+	char id[];
+};
+
+static struct avl_tree retained;
+static LIST_HEAD(retained_list);
+static unsigned int retained_bytes;
+
+/*
+ * Objects that asked for batched delivery get their events packed into a
+ * single "ubus.event.batch" invoke, which is sent once the latency of the
+ * batch expired or it grew beyond UBUSD_EVENT_BATCH_SIZE.
+ *
+ * Batching is strictly opt-in: a client must pass "batch" on register and
+ * unpack the frame itself. Registrations without it, such as the ones made
+ * by 'ubus2 listen' through the client library, keep getting one message
+ * per event.
+ */
+struct ubusd_event_batch {
+	struct uloop_timeout timer;
+	struct ubusd_object *obj;
+	struct blob_buf buf;
+	blob_offset_t table, array;
+	int latency;
+	int count;
+};
+
+/*
+ * Globs work on dot separated segments: '*' matches within a segment,
+ * "**" across any number of segments and [a-z] or [!a-z] match one
+ * character of a class within a segment. A glob is compiled into a string
+ * of tokens, the operation in the high byte and a character or class index
+ * in the low one.
+ */
+enum {
+	GLOB_END,
+	GLOB_CHAR,
+	GLOB_CLASS,
+	GLOB_STAR,
+	GLOB_ANY,
+};
+
+#define GLOB_TOK(op, val)	(((op) << 8) | (uint8_t) (val))
+#define GLOB_MAX_CLASSES	256
+
+struct event_glob {
+	uint8_t (*class)[32];
+	uint16_t tok[];
 };
 
+static const char *event_glob_start(const char *pattern)
+{
+	const char *glob = strpbrk(pattern, "*[");
+
+	/* a trailing '*' on its own is a plain prefix match */
+	if (glob && glob[0] == '*' && !glob[1])
+		return NULL;
+
+	return glob;
+}
+
+static const char *event_glob_compile_class(const char *s, uint8_t *class)
+{
+	bool invert = false;
+	int c, i;
+
+	if (*s == '!' || *s == '^') {
+		invert = true;
+		s++;
+	}
+
+	/* a ']' right after the opening bracket is part of the class */
+	do {
+		if (!*s)
+			return NULL;
+
+		c = (uint8_t) *s;
+		if (s[1] == '-' && s[2] && s[2] != ']') {
+			for (; c <= (uint8_t) s[2]; c++)
+				class[c >> 3] |= 1 << (c & 7);
+			s += 3;
+		} else {
+			class[c >> 3] |= 1 << (c & 7);
+			s++;
+		}
+	} while (*s != ']');
+
+	if (invert) {
+		for (i = 0; i < 32; i++)
+			class[i] = ~class[i];
+	}
+
+	/* classes never match the segment separator */
+	class['.' >> 3] &= ~(1 << ('.' & 7));
+
+	return s + 1;
+}
+
+static struct event_glob *event_glob_compile(const char *pattern)
+{
+	struct event_glob *glob;
+	int n_tok = strlen(pattern) + 1, n_class = 0;
+	const char *s;
+	uint16_t *tok;
+
+	for (s = pattern; (s = strchr(s, '[')); s++)
+		n_class++;
+
+	if (n_class > GLOB_MAX_CLASSES)
+		return NULL;
+
+	n_tok = (n_tok + 1) & ~1;
+	glob = calloc(1, sizeof(*glob) + n_tok * sizeof(*tok) + n_class * 32);
+	if (!glob)
+		return NULL;
+
+	glob->class = (void *) &glob->tok[n_tok];
+	tok = glob->tok;
+	n_class = 0;
+
+	for (s = pattern; *s;) {
+		switch (*s) {
+		case '*':
+			if (s[1] == '*') {
+				while (*s == '*')
+					s++;
+				*tok++ = GLOB_TOK(GLOB_ANY, 0);
+			} else {
+				s++;
+				*tok++ = GLOB_TOK(GLOB_STAR, 0);
+			}
+			break;
+		case '[':
+			s = event_glob_compile_class(s + 1, glob->class[n_class]);
+			if (!s)
+				goto error;
+
+			*tok++ = GLOB_TOK(GLOB_CLASS, n_class++);
+			break;
+		default:
+			*tok++ = GLOB_TOK(GLOB_CHAR, *s++);
+			break;
+		}
+	}
+
+	*tok = GLOB_TOK(GLOB_END, 0);
+	return glob;
+
+error:
+	free(glob);
+	return NULL;
+}
+
+/*
+ * Iterative matcher that only backtracks to the most recent '*' and "**".
+ * A '*' cannot cross a '.', so once it is stuck the earlier ones cannot
+ * help either and only the last "**" is retried. This keeps the cost at
+ * O(pattern * id) instead of exponential in the number of wildcards.
+ */
+static bool event_glob_match(struct event_glob *glob, const uint16_t *tok,
+			     const char *s)
+{
+	const uint16_t *star_tok = NULL, *any_tok = NULL;
+	const char *star_s = NULL, *any_s = NULL;
+	uint8_t c;
+
+	for (;;) {
+		c = *s;
+
+		switch (*tok >> 8) {
+		case GLOB_END:
+			if (!c)
+				return true;
+			break;
+		case GLOB_CHAR:
+			if (c == (uint8_t) *tok)
+				goto next;
+			break;
+		case GLOB_CLASS:
+			if (c && (glob->class[(uint8_t) *tok][c >> 3] & (1 << (c & 7))))
+				goto next;
+			break;
+		case GLOB_STAR:
+			star_tok = ++tok;
+			star_s = s;
+			continue;
+		case GLOB_ANY:
+			any_tok = ++tok;
+			any_s = s;
+			star_tok = NULL;
+			continue;
+		}
+
+		if (star_tok && *star_s && *star_s != '.') {
+			tok = star_tok;
+			s = ++star_s;
+		} else if (any_tok && *any_s) {
+			tok = any_tok;
+			s = ++any_s;
+			star_tok = NULL;
+		} else {
+			return false;
+		}
+		continue;
+
+next:
+		tok++;
+		s++;
+	}
+}
+
+static void event_node_init(struct event_node *node)
+{
+	INIT_LIST_HEAD(&node->exact);
+	INIT_LIST_HEAD(&node->partial);
+	INIT_LIST_HEAD(&node->glob);
+}
+
+static int event_node_child_idx(struct event_node *node, char c, bool *found)
+{
+	int lo = 0, hi = node->n_children;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		char cur = node->children[mid]->label[0];
+
+		if (cur == c) {
+			*found = true;
+			return mid;
+		}
+
+		if (cur < c)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	*found = false;
+	return lo;
+}
+
+static struct event_node *event_node_child(struct event_node *node, char c)
+{
+	bool found;
+	int idx = event_node_child_idx(node, c, &found);
+
+	return found ? node->children[idx] : NULL;
+}
+
+static bool event_node_set_child(struct event_node *node, struct event_node *child)
+{
+	struct event_node **children;
+	bool found;
+	int idx = event_node_child_idx(node, child->label[0], &found);
+
+	child->parent = node;
+	if (found) {
+		node->children[idx] = child;
+		return true;
+	}
+
+	children = realloc(node->children, (node->n_children + 1) * sizeof(*children));
+	if (!children)
+		return false;
+
+	memmove(&children[idx + 1], &children[idx],
+		(node->n_children - idx) * sizeof(*children));
+	children[idx] = child;
+	node->children = children;
+	node->n_children++;
+
+	return true;
+}
+
+static struct event_node *event_node_new(const char *label, int len)
+{
+	struct event_node *node;
+
+	node = calloc(1, sizeof(*node) + len + 1);
+	if (!node)
+		return NULL;
+
+	event_node_init(node);
+	memcpy(node + 1, label, len);
+	node->label = (const char *) (node + 1);
+	node->len = len;
+
+	return node;
+}
+
+/*
+ * Split the label of a node after len characters. The node keeps its
+ * allocation, its label just starts further into it.
+ */
+static struct event_node *event_node_split(struct event_node *node, int len)
+{
+	struct event_node *parent = node->parent;
+	struct event_node *prefix;
+
+	prefix = event_node_new(node->label, len);
+	if (!prefix)
+		return NULL;
+
+	prefix->children = malloc(sizeof(*prefix->children));
+	if (!prefix->children) {
+		free(prefix);
+		return NULL;
+	}
+
+	/* replaces node, both labels start with the same character */
+	event_node_set_child(parent, prefix);
+
+	node->label += len;
+	node->len -= len;
+	node->parent = prefix;
+	prefix->children[0] = node;
+	prefix->n_children = 1;
+
+	return prefix;
+}
+
+static struct event_node *event_node_get(const char *key)
+{
+	struct event_node *node = &patterns, *child;
+	int i;
+
+	while (*key) {
+		child = event_node_child(node, *key);
+		if (!child) {
+			child = event_node_new(key, strlen(key));
+			if (!child)
+				return NULL;
+
+			if (!event_node_set_child(node, child)) {
+				free(child);
+				return NULL;
+			}
+
+			return child;
+		}
+
+		for (i = 1; i < child->len && key[i] == child->label[i]; i++);
+
+		if (i < child->len) {
+			child = event_node_split(child, i);
+			if (!child)
+				return NULL;
+		}
+
+		key += i;
+		node = child;
+	}
+
+	return node;
+}
+
+static void event_node_put(struct event_node *node)
+{
+	struct event_node *parent;
+	bool found;
+	int idx;
+
+	while (node != &patterns && !node->n_children &&
+	       list_empty(&node->exact) && list_empty(&node->partial) &&
+	       list_empty(&node->glob)) {
+		parent = node->parent;
+		idx = event_node_child_idx(parent, node->label[0], &found);
+		memmove(&parent->children[idx], &parent->children[idx + 1],
+			(parent->n_children - idx - 1) * sizeof(*parent->children));
+		if (!--parent->n_children) {
+			free(parent->children);
+			parent->children = NULL;
+		}
+
+		free(node);
+		node = parent;
+	}
+}
+
+static void event_source_clear_pending(struct event_source *evs)
+{
+	struct event_pending *p, *tmp;
+
+	avl_for_each_element_safe(&evs->pending, p, avl, tmp) {
+		avl_delete(&evs->pending, &p->avl);
+		ubusd_msg_free(p->ub);
+		free(p);
+	}
+}
+
 static void ubusd_delete_event_source(struct event_source *evs)
 {
+	uloop_timeout_cancel(&uloop, &evs->timer);
+	event_source_clear_pending(evs);
 	list_del(&evs->list);
-	avl_delete(&patterns, &evs->avl);
+	list_del(&evs->node_list);
+	event_node_put(evs->node);
+	free(evs->filter);
+	free(evs->glob);
 	free(evs);
 }
 
+static void ubusd_event_batch_free(struct ubusd_event_batch *batch)
+{
+	uloop_timeout_cancel(&uloop, &batch->timer);
+	blob_buf_free(&batch->buf);
+	free(batch);
+}
+
 void ubusd_event_cleanup_object(struct ubusd_object *obj)
 {
 	struct event_source *ev;
@@ -41,27 +487,152 @@ void ubusd_event_cleanup_object(struct ubusd_object *obj)
 		ev = list_first_entry(&obj->events, struct event_source, list);
 		ubusd_delete_event_source(ev);
 	}
+
+	if (obj->event_batch) {
+		ubusd_event_batch_free(obj->event_batch);
+		obj->event_batch = NULL;
+	}
+}
+
+static struct blob_attr *event_data_get(struct blob_attr *data, const char *key)
+{
+	struct blob_attr *cur;
+
+	for (cur = blob_attr_first_child(data); cur;
+	     cur = blob_attr_next_child(data, cur)) {
+		bool match = blob_attr_type(cur) == BLOB_ATTR_STRING &&
+			     !strcmp(blob_attr_get_string(cur), key);
+
+		cur = blob_attr_next_child(data, cur);
+		if (!cur || match)
+			return cur;
+	}
+
+	return NULL;
+}
+
+/*
+ * A filter is a table of conditions on the top level fields of the event
+ * data, all of which have to hold. A string ending in '*' matches as a
+ * prefix, a boolean requires the field to be present or absent and any
+ * other value has to be equal.
+ */
+static bool event_filter_match(struct blob_attr *filter, struct blob_attr *data)
+{
+	struct blob_attr *key, *cond, *val;
+	const char *str;
+	int len;
+
+	for (key = blob_attr_first_child(filter); key;
+	     key = blob_attr_next_child(filter, cond)) {
+		cond = blob_attr_next_child(filter, key);
+		if (!cond)
+			break;
+
+		val = event_data_get(data, blob_attr_get_string(key));
+
+		switch (blob_attr_type(cond)) {
+		case BLOB_ATTR_INT8:
+			if (!val == !blob_attr_get_bool(cond))
+				break;
+			return false;
+		case BLOB_ATTR_STRING:
+			str = blob_attr_get_string(cond);
+			len = strlen(str);
+			if (len && str[len - 1] == '*') {
+				if (!val || blob_attr_type(val) != BLOB_ATTR_STRING ||
+				    strncmp(blob_attr_get_string(val), str, len - 1) != 0)
+					return false;
+				break;
+			}
+			/* fall through */
+		default:
+			if (!val || !blob_attr_equal(val, cond))
+				return false;
+			break;
+		}
+	}
+
+	return true;
+}
+
+static bool event_filter_valid(struct blob_attr *filter)
+{
+	struct blob_attr *cur;
+	bool key = true;
+
+	for (cur = blob_attr_first_child(filter); cur;
+	     cur = blob_attr_next_child(filter, cur)) {
+		if (key && blob_attr_type(cur) != BLOB_ATTR_STRING)
+			return false;
+		key = !key;
+	}
+
+	return key;
 }
 
 enum {
 	EVREG_PATTERN,
 	EVREG_OBJECT,
+	EVREG_FILTER,
+	EVREG_COALESCE,
+	EVREG_RATE,
+	EVREG_BATCH,
+	EVREG_REPLAY,
 	EVREG_LAST,
 };
 
 static struct blob_attr_policy evr_policy[] = {
 	[EVREG_PATTERN] = { .name = "pattern", .type = BLOB_ATTR_STRING },
 	[EVREG_OBJECT] = { .name = "object", .type = BLOB_ATTR_INT32 },
+	[EVREG_FILTER] = { .name = "filter", .type = BLOB_ATTR_TABLE },
+	[EVREG_COALESCE] = { .name = "coalesce", .type = BLOB_ATTR_INT32 },
+	[EVREG_RATE] = { .name = "rate", .type = BLOB_ATTR_INT32 },
+	[EVREG_BATCH] = { .name = "batch", .type = BLOB_ATTR_INT32 },
+	[EVREG_REPLAY] = { .name = "replay", .type = BLOB_ATTR_INT8 },
 };
 
+static void event_source_timeout_cb(struct uloop_timeout *t);
+static void ubusd_event_batch_timeout_cb(struct uloop_timeout *t);
+
+/* the batch latency of an object is the lowest one any of its patterns asked for */
+static int ubusd_event_batch_init(struct ubusd_object *obj, int latency)
+{
+	struct ubusd_event_batch *batch = obj->event_batch;
+
+	if (latency < 0)
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	if (batch) {
+		if (latency < batch->latency)
+			batch->latency = latency;
+		return 0;
+	}
+
+	batch = calloc(1, sizeof(*batch));
+	if (!batch)
+		return UBUS_STATUS_NO_DATA;
+
+	blob_buf_init(&batch->buf, 0, 0);
+	batch->timer.cb = ubusd_event_batch_timeout_cb;
+	batch->obj = obj;
+	batch->latency = latency;
+	obj->event_batch = batch;
+
+	return 0;
+}
+static void ubusd_event_replay(struct event_source *ev);
+
 static int ubusd_alloc_event_pattern(struct ubusd_client *cl, struct blob_attr *msg)
 {
 	struct event_source *ev;
 	struct ubusd_object *obj;
-	struct blob_attr *attr[EVREG_LAST];
-	char *pattern, *name;
+	struct blob_attr *attr[EVREG_LAST], *filter;
+	struct list_head *list;
+	char *pattern, *glob;
 	uint32_t id;
 	bool partial = false;
+	int interval = 0;
 	int len;
 
 	blob_attr_parse(msg, attr, evr_policy, EVREG_LAST); 
@@ -80,141 +651,533 @@ static int ubusd_alloc_event_pattern(struct ubusd_client *cl, struct blob_attr *
 	if (obj->client != cl)
 		return UBUS_STATUS_PERMISSION_DENIED;
 
-	pattern = blob_attr_data(attr[EVREG_PATTERN]);
+	filter = attr[EVREG_FILTER];
+	if (filter && !event_filter_valid(filter))
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	if (attr[EVREG_COALESCE])
+		interval = blob_attr_get_i32(attr[EVREG_COALESCE]);
+	if (interval < 0)
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	/*
+	 * a rate limit is a minimum interval between two deliveries, rounded
+	 * up so that the rate is never exceeded and at least 1 ms
+	 */
+	if (attr[EVREG_RATE]) {
+		int rate = blob_attr_get_i32(attr[EVREG_RATE]);
+		int rate_interval;
+
+		if (rate < 0)
+			return UBUS_STATUS_INVALID_ARGUMENT;
+
+		if (rate) {
+			rate_interval = (1000 + rate - 1) / rate;
+			if (rate_interval > interval)
+				interval = rate_interval;
+		}
+	}
+
+	if (attr[EVREG_BATCH]) {
+		int ret = ubusd_event_batch_init(obj, blob_attr_get_i32(attr[EVREG_BATCH]));
 
-	len = strlen(pattern);
-	if (pattern[len - 1] == '*') {
-		partial = true;
-		pattern[len - 1] = 0;
-		len--;
+		if (ret)
+			return ret;
 	}
 
-	ev = calloc(1, sizeof(*ev) + len + 1);
+	pattern = blob_attr_data(attr[EVREG_PATTERN]);
+
+	ev = calloc(1, sizeof(*ev));
 	if (!ev)
 		return UBUS_STATUS_NO_DATA;
 
+	if (filter) {
+		ev->filter = malloc(blob_attr_raw_len(filter));
+		if (!ev->filter) {
+			free(ev);
+			return UBUS_STATUS_NO_DATA;
+		}
+
+		memcpy(ev->filter, filter, blob_attr_raw_len(filter));
+	}
+
+	glob = (char *) event_glob_start(pattern);
+	if (glob) {
+		ev->glob = event_glob_compile(glob);
+		if (!ev->glob) {
+			free(ev->filter);
+			free(ev);
+			return UBUS_STATUS_INVALID_ARGUMENT;
+		}
+
+		*glob = 0;
+	} else {
+		len = strlen(pattern);
+		if (len && pattern[len - 1] == '*') {
+			partial = true;
+			pattern[len - 1] = 0;
+		}
+	}
+
+	ev->node = event_node_get(pattern);
+	if (!ev->node) {
+		free(ev->filter);
+		free(ev->glob);
+		free(ev);
+		return UBUS_STATUS_NO_DATA;
+	}
+
+	if (ev->glob)
+		list = &ev->node->glob;
+	else if (partial)
+		list = &ev->node->partial;
+	else
+		list = &ev->node->exact;
+
 	list_add(&ev->list, &obj->events);
+	list_add_tail(&ev->node_list, list);
 	ev->obj = obj;
 	ev->partial = partial;
-	name = (char *) (ev + 1);
-	strcpy(name, pattern);
-	ev->avl.key = name;
-	avl_insert(&patterns, &ev->avl);
+	ev->interval = interval;
+	ev->timer.cb = event_source_timeout_cb;
+	ubusd_init_string_tree(&ev->pending, false);
+
+	if (attr[EVREG_REPLAY] && blob_attr_get_bool(attr[EVREG_REPLAY]))
+		ubusd_event_replay(ev);
 
 	return 0;
 }
 
-typedef struct ubusd_msg_buf *(*event_fill_cb)(void *priv, const char *id);
+struct event_dispatch {
+	struct ubusd_client *cl; /* sender, does not get its own events */
+	const char *id;
+	struct blob_attr *data;
+	struct ubusd_msg_buf *ub; /* payload shared by all recipients */
+};
+
+static struct ubusd_msg_buf *ubusd_create_event_msg(const char *id, struct blob_attr *data)
+{
+	struct ubusd_msg_buf *ub;
+
+	blob_buf_reset(&b);
+	blob_buf_put_i32(&b, 0);
+	blob_buf_put_string(&b, id);
+	blob_buf_put_attr(&b, data);
+
+	ub = ubusd_msg_new(blob_buf_head(&b), blob_buf_size(&b), false);
+	if (!ub)
+		return NULL;
+
+	ub->hdr.type = UBUS_MSG_INVOKE;
+	ub->hdr.peer = 0;
+
+	return ub;
+}
+
+static struct blob_attr *ubusd_event_msg_data(struct ubusd_msg_buf *ub)
+{
+	struct blob_attr *cur;
+
+	/* skip the object id and the event id */
+	cur = blob_attr_first_child(ub->data);
+	cur = blob_attr_next_child(ub->data, cur);
+	return blob_attr_next_child(ub->data, cur);
+}
 
-static void ubusd_send_event_msg(struct ubusd_msg_buf **ub, struct ubusd_client *cl,
-				 struct ubusd_object *obj, const char *id,
-				 event_fill_cb fill_cb, void *cb_priv)
+static void ubusd_event_batch_flush(struct ubusd_event_batch *batch)
 {
+	struct ubusd_msg_buf *ub;
+
+	if (!batch->count)
+		return;
+
+	uloop_timeout_cancel(&uloop, &batch->timer);
+	blob_buf_close_array(&batch->buf, batch->array);
+	blob_buf_close_table(&batch->buf, batch->table);
+	batch->count = 0;
+
+	ub = ubusd_msg_new(blob_buf_head(&batch->buf), blob_buf_size(&batch->buf), false);
+	if (!ub)
+		return;
+
+	ub->hdr.type = UBUS_MSG_INVOKE;
+	ub->hdr.peer = 0;
+	ub->hdr.seq = ++event_seq;
+	ubusd_msg_send(batch->obj->client, ub, true);
+}
+
+static void ubusd_event_batch_timeout_cb(struct uloop_timeout *t)
+{
+	ubusd_event_batch_flush(container_of(t, struct ubusd_event_batch, timer));
+}
+
+static void ubusd_event_batch_add(struct ubusd_event_batch *batch, struct ubusd_msg_buf *ub)
+{
+	struct blob_attr *data = ubusd_event_msg_data(ub);
+	struct blob_attr *id = blob_attr_next_child(ub->data, blob_attr_first_child(ub->data));
+	blob_offset_t t;
+
+	if (!batch->count) {
+		blob_buf_reset(&batch->buf);
+		blob_buf_put_i32(&batch->buf, batch->obj->id.id);
+		blob_buf_put_string(&batch->buf, "ubus.event.batch");
+		batch->table = blob_buf_open_table(&batch->buf);
+		blob_buf_put_string(&batch->buf, "events");
+		batch->array = blob_buf_open_array(&batch->buf);
+		uloop_timeout_set(&uloop, &batch->timer, batch->latency);
+	}
+
+	t = blob_buf_open_table(&batch->buf);
+	blob_buf_put_string(&batch->buf, "id");
+	blob_buf_put_string(&batch->buf, blob_attr_get_string(id));
+	blob_buf_put_string(&batch->buf, "data");
+	blob_buf_put_attr(&batch->buf, data);
+	blob_buf_close_table(&batch->buf, t);
+	batch->count++;
+
+	if (blob_buf_size(&batch->buf) >= UBUSD_EVENT_BATCH_SIZE)
+		ubusd_event_batch_flush(batch);
+}
+
+/*
+ * All recipients share the payload, each of them only gets a private copy
+ * of the message start that holds its object id.
+ */
+static void ubusd_event_deliver(struct ubusd_object *obj, struct ubusd_msg_buf *ub)
+{
+	struct ubusd_msg_buf *msg;
+	struct blob_attr *objid;
 	uint32_t *objid_ptr;
 
+	if (obj->event_batch) {
+		ubusd_event_batch_add(obj->event_batch, ub);
+		return;
+	}
+
+	objid = blob_attr_first_child(ub->data);
+	msg = ubusd_msg_new_patch(ub, (char *) objid - (char *) ub->data +
+				  blob_attr_pad_len(objid));
+	if (!msg)
+		return;
+
+	objid_ptr = blob_attr_data(blob_attr_data(msg->data));
+	*objid_ptr = htonl(obj->id.id);
+
+	msg->hdr.seq = ++event_seq;
+	ubusd_msg_send(obj->client, msg, true);
+}
+
+/* keeps only the newest payload per event id until the interval ends */
+static void event_source_hold(struct event_source *ev, const char *id,
+			      struct ubusd_msg_buf *ub)
+{
+	struct event_pending *p;
+
+	p = avl_find_element(&ev->pending, id, p, avl);
+	if (p) {
+		ubusd_msg_free(p->ub);
+		p->ub = ubusd_msg_ref(ub);
+		return;
+	}
+
+	p = calloc(1, sizeof(*p) + strlen(id) + 1);
+	if (!p)
+		return;
+
+	strcpy(p->id, id);
+	p->avl.key = p->id;
+	p->ub = ubusd_msg_ref(ub);
+	avl_insert(&ev->pending, &p->avl);
+}
+
+static void event_source_timeout_cb(struct uloop_timeout *t)
+{
+	struct event_source *ev = container_of(t, struct event_source, timer);
+	struct event_pending *p;
+
+	/* nothing came in during the interval, the next event goes out directly */
+	if (avl_is_empty(&ev->pending))
+		return;
+
+	avl_for_each_element(&ev->pending, p, avl)
+		ubusd_event_deliver(ev->obj, p->ub);
+
+	event_source_clear_pending(ev);
+	uloop_timeout_set(&uloop, &ev->timer, ev->interval);
+}
+
+static void ubusd_send_event_msg(struct event_dispatch *d, struct event_source *ev)
+{
+	struct ubusd_object *obj = ev->obj;
+
 	/* do not loop back events */
-	if (obj->client == cl)
+	if (obj->client == d->cl)
 	    return;
 
 	/* do not send duplicate events */
 	if (obj->event_seen == obj_event_seq)
 		return;
 
+	if (ev->filter && !event_filter_match(ev->filter, d->data))
+		return;
+
 	obj->event_seen = obj_event_seq;
 
-	if (!*ub) {
-		*ub = fill_cb(cb_priv, id);
-		(*ub)->hdr.type = UBUS_MSG_INVOKE;
-		(*ub)->hdr.peer = 0;
+	if (!d->ub) {
+		d->ub = ubusd_create_event_msg(d->id, d->data);
+		if (!d->ub)
+			return;
 	}
 
-	objid_ptr = blob_attr_data(blob_attr_data((*ub)->data));
-	*objid_ptr = htonl(obj->id.id);
+	if (ev->interval) {
+		if (ev->timer.pending) {
+			event_source_hold(ev, d->id, d->ub);
+			return;
+		}
+
+		uloop_timeout_set(&uloop, &ev->timer, ev->interval);
+	}
 
-	(*ub)->hdr.seq = ++event_seq;
-	ubusd_msg_send(obj->client, *ub, false);
+	ubusd_event_deliver(obj, d->ub);
 }
 
-static bool strmatch_len(const char *s1, const char *s2, int *len)
+static void ubusd_send_event_list(struct event_dispatch *d, struct list_head *list)
 {
-	for (*len = 0; s1[*len] == s2[*len]; (*len)++)
-		if (!s1[*len])
-			return true;
+	struct event_source *ev;
 
-	return false;
+	list_for_each_entry(ev, list, node_list)
+		ubusd_send_event_msg(d, ev);
 }
 
-static int ubusd_send_event(struct ubusd_client *cl, const char *id,
-			    event_fill_cb fill_cb, void *cb_priv)
+static void ubusd_send_event_glob(struct event_dispatch *d, struct list_head *list,
+				  const char *key)
 {
-	struct ubusd_msg_buf *ub = NULL;
 	struct event_source *ev;
-	int match_len = 0;
+
+	list_for_each_entry(ev, list, node_list) {
+		if (event_glob_match(ev->glob, ev->glob->tok, key))
+			ubusd_send_event_msg(d, ev);
+	}
+}
+
+static void ubusd_event_retain(struct ubusd_client *cl, const char *id,
+			       struct ubusd_msg_buf *ub);
+
+static int ubusd_send_event(struct ubusd_client *cl, const char *id,
+			    struct blob_attr *data, bool retain)
+{
+	struct event_dispatch d = {
+		.cl = cl,
+		.id = id,
+		.data = data,
+	};
+	struct event_node *node = &patterns;
+	const char *key = id;
 
 	obj_event_seq++;
 
 	/*
-	 * Since this tree is sorted alphabetically, we can only expect to find
-	 * matching entries as long as the number of matching characters
-	 * between the pattern string and our string is monotonically increasing.
+	 * Every node on the path of the id is a prefix of it, so its partial
+	 * patterns match and its globs only need to match the rest of the id.
+	 * Exact patterns only match on the node where the whole id has been
+	 * consumed.
 	 */
-	avl_for_each_element(&patterns, ev, avl) {
-		const char *key = ev->avl.key;
-		int cur_match_len;
-		bool full_match;
+	while (node) {
+		ubusd_send_event_list(&d, &node->partial);
+		ubusd_send_event_glob(&d, &node->glob, key);
 
-		full_match = strmatch_len(id, key, &cur_match_len);
-		if (cur_match_len < match_len)
+		if (!*key) {
+			ubusd_send_event_list(&d, &node->exact);
 			break;
+		}
 
-		match_len = cur_match_len;
+		node = event_node_child(node, *key);
+		if (!node || strncmp(key, node->label, node->len) != 0)
+			break;
 
-		if (!full_match) {
-			if (!ev->partial)
-				continue;
+		key += node->len;
+	}
 
-			if (match_len != strlen(key))
-				continue;
-		}
+	if (retain && !d.ub)
+		d.ub = ubusd_create_event_msg(id, data);
 
-		ubusd_send_event_msg(&ub, cl, ev->obj, id, fill_cb, cb_priv);
-	}
+	if (!d.ub)
+		return 0;
 
-	if (ub)
-		ubusd_msg_free(ub);
+	if (retain)
+		ubusd_event_retain(cl, id, d.ub);
+
+	ubusd_msg_free(d.ub);
 
 	return 0;
 }
 
+static void ubusd_event_retain_free(struct event_retained *r)
+{
+	avl_delete(&retained, &r->avl);
+	list_del(&r->list);
+	retained_bytes -= r->ub->len;
+	ubusd_msg_free(r->ub);
+	free(r);
+}
+
+static void ubusd_event_retain(struct ubusd_client *cl, const char *id,
+			       struct ubusd_msg_buf *ub)
+{
+	struct event_retained *r;
+
+	/* a single payload that does not fit is not retained at all */
+	if (ub->len > UBUSD_EVENT_RETAIN_BYTES)
+		return;
+
+	r = avl_find_element(&retained, id, r, avl);
+	if (r) {
+		retained_bytes -= r->ub->len;
+		ubusd_msg_free(r->ub);
+		list_del(&r->list);
+	} else {
+		r = calloc(1, sizeof(*r) + strlen(id) + 1);
+		if (!r)
+			return;
+
+		strcpy(r->id, id);
+		r->avl.key = r->id;
+		avl_insert(&retained, &r->avl);
+	}
+
+	while (!list_empty(&retained_list) &&
+	       (retained.count > UBUSD_EVENT_RETAIN_MAX ||
+		retained_bytes + ub->len > UBUSD_EVENT_RETAIN_BYTES))
+		ubusd_event_retain_free(list_first_entry(&retained_list,
+							 struct event_retained, list));
+
+	r->client = cl->id.id;
+	r->ub = ubusd_msg_ref(ub);
+	retained_bytes += ub->len;
+	list_add_tail(&r->list, &retained_list);
+}
+
+void ubusd_event_cleanup_client(struct ubusd_client *cl)
+{
+	struct event_retained *r, *tmp;
+
+	list_for_each_entry_safe(r, tmp, &retained_list, list) {
+		if (r->client == cl->id.id)
+			ubusd_event_retain_free(r);
+	}
+}
+
+/* returns the part of id after the literal prefix of a node, if it has it */
+static const char *event_node_match_prefix(struct event_node *node, const char *id)
+{
+	struct event_node *cur;
+	int len = 0, ofs;
+
+	for (cur = node; cur != &patterns; cur = cur->parent)
+		len += cur->len;
+
+	if (strnlen(id, len) < len)
+		return NULL;
+
+	for (cur = node, ofs = len; cur != &patterns; cur = cur->parent) {
+		ofs -= cur->len;
+		if (memcmp(id + ofs, cur->label, cur->len) != 0)
+			return NULL;
+	}
+
+	return id + len;
+}
+
+static bool event_source_match(struct event_source *ev, const char *id)
+{
+	const char *rest = event_node_match_prefix(ev->node, id);
+
+	if (!rest)
+		return false;
+
+	if (ev->glob)
+		return event_glob_match(ev->glob, ev->glob->tok, rest);
+
+	return ev->partial || !*rest;
+}
+
+static struct blob_attr *ubusd_obj_event_data(struct ubusd_object *obj)
+{
+	void *s;
+
+	blob_buf_reset(&ev_buf);
+	s = blob_buf_open_table(&ev_buf);
+	blob_buf_put_string(&ev_buf, "id");
+	blob_buf_put_u32(&ev_buf, obj->id.id);
+	blob_buf_put_string(&ev_buf, "path");
+	blob_buf_put_string(&ev_buf, ubusd_path_name(obj->path));
+	blob_buf_close_table(&ev_buf, s);
+
+	return blob_attr_first_child(blob_buf_head(&ev_buf));
+}
+
+/*
+ * Hands the retained events matching a new registration to its object, if
+ * it asked for a replay. The registry itself holds the current state of
+ * object add events, so those are generated for every object that exists.
+ */
+static void ubusd_event_replay(struct event_source *ev)
+{
+	static const char *obj_add = "ubus.object.add";
+	struct event_retained *r;
+	struct ubusd_object *obj;
+	struct ubusd_msg_buf *ub;
+	struct blob_attr *data;
+
+	avl_for_each_element(&retained, r, avl) {
+		if (!event_source_match(ev, r->id))
+			continue;
+
+		if (ev->filter && !event_filter_match(ev->filter, ubusd_event_msg_data(r->ub)))
+			continue;
+
+		ubusd_event_deliver(ev->obj, r->ub);
+	}
+
+	if (!event_source_match(ev, obj_add))
+		return;
+
+	ubusd_id_map_for_each_element(&objects, obj, id) {
+		if (!obj->path)
+			continue;
+
+		data = ubusd_obj_event_data(obj);
+		if (ev->filter && !event_filter_match(ev->filter, data))
+			continue;
+
+		ub = ubusd_create_event_msg(obj_add, data);
+		if (!ub)
+			continue;
+
+		ubusd_event_deliver(ev->obj, ub);
+		ubusd_msg_free(ub);
+	}
+}
+
 enum {
 	EVMSG_ID,
 	EVMSG_DATA,
+	EVMSG_RETAIN,
 	EVMSG_LAST,
 };
 
 static struct blob_attr_policy ev_policy[] = {
 	[EVMSG_ID] = { .name = "id", .type = BLOB_ATTR_STRING },
 	[EVMSG_DATA] = { .name = "data", .type = BLOB_ATTR_TABLE },
+	[EVMSG_RETAIN] = { .name = "retain", .type = BLOB_ATTR_INT8 },
 };
 
-static struct ubusd_msg_buf *
-ubusd_create_event_from_msg(void *priv, const char *id)
-{
-	struct blob_attr *msg = priv;
-
-	blob_buf_reset(&b);
-	blob_buf_put_i32(&b, 0);
-	blob_buf_put_string(&b, id);
-	blob_buf_put_attr(&b, msg); 
-
-	return ubusd_msg_new(blob_buf_head(&b), blob_buf_size(&b), true);
-}
-
 static int ubusd_forward_event(struct ubusd_client *cl, struct blob_attr *msg)
 {
 	struct blob_attr *data;
 	struct blob_attr *attr[EVMSG_LAST];
 	const char *id;
+	bool retain;
 
 	//blobmsg_parse(ev_policy, EVMSG_LAST, attr, blob_data(msg), blob_len(msg));
 	blob_attr_parse(msg, attr, ev_policy, EVMSG_LAST); 
@@ -227,10 +1190,13 @@ static int ubusd_forward_event(struct ubusd_client *cl, struct blob_attr *msg)
 	if (!strncmp(id, "ubus.", 5))
 		return UBUS_STATUS_PERMISSION_DENIED;
 
-	return ubusd_send_event(cl, id, ubusd_create_event_from_msg, data);
+	retain = attr[EVMSG_RETAIN] && blob_attr_get_bool(attr[EVMSG_RETAIN]);
+
+	return ubusd_send_event(cl, id, data, retain);
 }
 
-static int ubusd_event_recv(struct ubusd_client *cl, const char *method, struct blob_attr *msg)
+static int ubusd_event_recv(struct ubusd_client *cl, struct ubusd_msg_buf *ub,
+			    const char *method, struct blob_attr *msg)
 {
 	if (!strcmp(method, "register"))
 		return ubusd_alloc_event_pattern(cl, msg);
@@ -241,35 +1207,18 @@ static int ubusd_event_recv(struct ubusd_client *cl, const char *method, struct
 	return UBUS_STATUS_INVALID_COMMAND;
 }
 
-static struct ubusd_msg_buf *
-ubusd_create_object_event_msg(void *priv, const char *id)
-{
-	struct ubusd_object *obj = priv;
-	void *s;
-
-	blob_buf_reset(&b);
-	blob_buf_put_i32(&b, 0); // object id
-	blob_buf_put_string(&b, id);
-	s = blob_buf_open_table(&b);
-	blob_buf_put_string(&b, "id"); 
-	blob_buf_put_u32(&b, obj->id.id);
-	blob_buf_put_string(&b, "path"); 
-	blob_buf_put_string(&b, obj->path.key);
-	blob_buf_close_table(&b, s);
-
-	return ubusd_msg_new(blob_buf_head(&b), blob_buf_size(&b), true);
-}
-
 void ubusd_send_obj_event(struct ubusd_object *obj, bool add)
 {
 	const char *id = add ? "ubus.object.add" : "ubus.object.remove";
 
-	ubusd_send_event(NULL, id, ubusd_create_object_event_msg, obj);
+	ubusd_send_event(NULL, id, ubusd_obj_event_data(obj), false);
 }
 
 void ubusd_event_init(void)
 {
-	ubusd_init_string_tree(&patterns, true);
+	blob_buf_init(&ev_buf, 0, 0);
+	event_node_init(&patterns);
+	ubusd_init_string_tree(&retained, false);
 	event_obj = ubusd_create_object_internal(NULL, UBUS_SYSTEM_OBJECT_EVENT);
 	if (event_obj != NULL)
 		event_obj->recv_msg = ubusd_event_recv;
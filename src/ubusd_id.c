@@ -15,14 +15,66 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <sys/random.h>
 #include <libutype/avl-cmp.h>
 #include <libubus2/libubus2.h>
 
 //#include "ubusmsg.h"
 #include "ubusd_id.h"
 
+/*
+ * Random numbers are taken from a pool that is refilled with one getrandom
+ * call, /dev/urandom is only used on kernels that lack the syscall.
+ */
+static uint32_t random_pool[256];
+static unsigned int random_avail;
 static int random_fd = -1;
 
+static bool ubusd_random_read(void *buf, size_t len)
+{
+	char *pos = buf;
+	ssize_t ret;
+
+	while (len) {
+		if (random_fd < 0) {
+			ret = getrandom(pos, len, 0);
+			if (ret < 0 && errno == ENOSYS) {
+				random_fd = open("/dev/urandom", O_RDONLY);
+				if (random_fd < 0)
+					return false;
+				continue;
+			}
+		} else {
+			ret = read(random_fd, pos, len);
+		}
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret <= 0)
+			return false;
+
+		pos += ret;
+		len -= ret;
+	}
+
+	return true;
+}
+
+static bool ubusd_random_u32(uint32_t *val)
+{
+	if (!random_avail) {
+		if (!ubusd_random_read(random_pool, sizeof(random_pool)))
+			return false;
+
+		random_avail = ARRAY_SIZE(random_pool);
+	}
+
+	*val = random_pool[--random_avail];
+	return true;
+}
+
 static int ubusd_cmp_id(const void *k1, const void *k2, void *ptr)
 {
 	const uint32_t *id1 = k1, *id2 = k2;
@@ -38,35 +90,163 @@ void ubusd_init_string_tree(struct avl_tree *tree, bool dup)
 	avl_init(tree, avl_strcmp, dup, NULL);
 }
 
-void ubusd_init_id_tree(struct avl_tree *tree)
+#define UBUSD_ID_SLOT_NONE	((uint32_t) ~0)
+
+bool ubusd_id_random = false;
+
+void ubusd_init_id_map(struct ubusd_id_map *map)
 {
-	if (random_fd < 0) {
-		random_fd = open("/dev/urandom", O_RDONLY);
-		if (random_fd < 0) {
-			perror("open");
+	/* fail early if there is no source of random numbers at all */
+	if (!random_avail) {
+		if (!ubusd_random_read(random_pool, sizeof(random_pool))) {
+			perror("getrandom");
 			exit(1);
 		}
+		random_avail = ARRAY_SIZE(random_pool);
 	}
 
-	avl_init(tree, ubusd_cmp_id, false, NULL);
+	memset(map, 0, sizeof(*map));
+	map->free_head = map->free_tail = UBUSD_ID_SLOT_NONE;
+	INIT_LIST_HEAD(&map->ids);
+	avl_init(&map->tree, ubusd_cmp_id, false, NULL);
 }
 
-bool ubusd_alloc_id(struct avl_tree *tree, struct ubusd_id *id, uint32_t val)
+static void ubusd_id_slot_release(struct ubusd_id_map *map, uint32_t idx)
 {
-	id->avl.key = &id->id;
-	if (val) {
-		id->id = val;
-		return avl_insert(tree, &id->avl) == 0;
+	map->slots[idx].next_free = UBUSD_ID_SLOT_NONE;
+
+	if (map->free_tail == UBUSD_ID_SLOT_NONE)
+		map->free_head = idx;
+	else
+		map->slots[map->free_tail].next_free = idx;
+
+	map->free_tail = idx;
+}
+
+static bool ubusd_id_map_grow(struct ubusd_id_map *map)
+{
+	unsigned int size = map->size ? map->size * 2 : 64;
+	struct ubusd_id_slot *slots;
+	uint32_t idx;
+
+	if (size > UBUSD_ID_SLOT_MASK + 1)
+		size = UBUSD_ID_SLOT_MASK + 1;
+
+	if (size == map->size)
+		return false;
+
+	slots = realloc(map->slots, size * sizeof(*slots));
+	if (!slots)
+		return false;
+
+	memset(slots + map->size, 0, (size - map->size) * sizeof(*slots));
+	map->slots = slots;
+
+	/* start every new slot at a random generation */
+	for (idx = map->size; idx < size; idx++) {
+		uint32_t gen;
+
+		if (!ubusd_random_u32(&gen))
+			gen = 0;
+
+		slots[idx].val = gen << UBUSD_ID_SLOT_BITS;
+		ubusd_id_slot_release(map, idx);
 	}
 
+	map->size = size;
+	return true;
+}
+
+static bool ubusd_alloc_slot_id(struct ubusd_id_map *map, struct ubusd_id *id)
+{
+	struct ubusd_id_slot *slot;
+	uint32_t idx;
+
+	if (map->free_head == UBUSD_ID_SLOT_NONE && !ubusd_id_map_grow(map))
+		return false;
+
+	idx = map->free_head;
+	slot = &map->slots[idx];
+	map->free_head = slot->next_free;
+	if (map->free_head == UBUSD_ID_SLOT_NONE)
+		map->free_tail = UBUSD_ID_SLOT_NONE;
+
+	/*
+	 * advance the generation by a random nonzero step so that the next ID
+	 * of a slot cannot be guessed from the previous one. Generation 0 would
+	 * clash with the system object range, so skip it together with anything
+	 * that is taken by a fixed or random ID
+	 */
+	do {
+		uint32_t step;
+
+		if (!ubusd_random_u32(&step))
+			step = 1;
+
+		step >>= UBUSD_ID_SLOT_BITS;
+		if (!step)
+			step = 1;
+
+		slot->val += step << UBUSD_ID_SLOT_BITS;
+		if (!(slot->val >> UBUSD_ID_SLOT_BITS))
+			slot->val += 1 << UBUSD_ID_SLOT_BITS;
+		slot->val = (slot->val & ~UBUSD_ID_SLOT_MASK) | idx;
+	} while (map->tree.count && avl_find(&map->tree, &slot->val));
+
+	slot->id = id;
+	id->id = slot->val;
+	return true;
+}
+
+static bool ubusd_alloc_random_id(struct ubusd_id_map *map, struct ubusd_id *id)
+{
 	do {
-		if (read(random_fd, &id->id, sizeof(id->id)) != sizeof(id->id))
+		if (!ubusd_random_u32(&id->id))
 			return false;
 
 		if (id->id < UBUS_SYSTEM_OBJECT_MAX)
 			continue;
-	} while (avl_insert(tree, &id->avl) != 0);
+
+		if (ubusd_find_id(map, id->id))
+			continue;
+	} while (avl_insert(&map->tree, &id->avl) != 0);
 
 	return true;
 }
 
+bool ubusd_alloc_id(struct ubusd_id_map *map, struct ubusd_id *id, uint32_t val)
+{
+	id->avl.key = &id->id;
+	if (val) {
+		if (ubusd_find_id(map, val))
+			return false;
+
+		id->id = val;
+		if (avl_insert(&map->tree, &id->avl) != 0)
+			return false;
+	} else if (ubusd_id_random) {
+		if (!ubusd_alloc_random_id(map, id))
+			return false;
+	} else {
+		if (!ubusd_alloc_slot_id(map, id))
+			return false;
+	}
+
+	list_add_tail(&id->list, &map->ids);
+	return true;
+}
+
+void ubusd_free_id(struct ubusd_id_map *map, struct ubusd_id *id)
+{
+	uint32_t idx = id->id & UBUSD_ID_SLOT_MASK;
+
+	list_del(&id->list);
+
+	if (idx < map->size && map->slots[idx].id == id) {
+		map->slots[idx].id = NULL;
+		ubusd_id_slot_release(map, idx);
+		return;
+	}
+
+	avl_delete(&map->tree, &id->avl);
+}
@@ -15,27 +15,68 @@
 #define __UBUSD_ID_H
 
 #include <libutype/avl.h>
+#include <libutype/list.h>
 #include <stdint.h>
 
+/*
+ * Dynamically allocated IDs encode a slot index in the lower bits and the
+ * generation of that slot in the upper bits, which makes lookups a single
+ * array access. Slots are reused in FIFO order and their generation is
+ * advanced by a random nonzero step on every reuse, so that stale IDs do not
+ * resolve to new entries and new IDs cannot be predicted from old ones.
+ * IDs with a fixed value and random IDs (ubusd_id_random) are kept in an
+ * AVL tree.
+ */
+#define UBUSD_ID_SLOT_BITS	16
+#define UBUSD_ID_SLOT_MASK	((1 << UBUSD_ID_SLOT_BITS) - 1)
+
 struct ubusd_id {
 	struct avl_node avl;
+	struct list_head list;
 	uint32_t id;
 };
 
-void ubusd_init_id_tree(struct avl_tree *tree);
-void ubusd_init_string_tree(struct avl_tree *tree, bool dup);
-bool ubusd_alloc_id(struct avl_tree *tree, struct ubusd_id *id, uint32_t val);
+struct ubusd_id_slot {
+	struct ubusd_id *id;
+	uint32_t val;
+	uint32_t next_free;
+};
 
-static inline void ubusd_free_id(struct avl_tree *tree, struct ubusd_id *id)
-{
-	avl_delete(tree, &id->avl);
-}
+struct ubusd_id_map {
+	struct ubusd_id_slot *slots;
+	unsigned int size;
+	uint32_t free_head, free_tail;
+
+	struct avl_tree tree;
+	struct list_head ids;
+};
+
+extern bool ubusd_id_random;
+
+#define ubusd_id_map_for_each_element(map, element, id_member) \
+	list_for_each_entry(element, &(map)->ids, id_member.list)
+
+void ubusd_init_id_map(struct ubusd_id_map *map);
+void ubusd_init_string_tree(struct avl_tree *tree, bool dup);
+bool ubusd_alloc_id(struct ubusd_id_map *map, struct ubusd_id *id, uint32_t val);
+void ubusd_free_id(struct ubusd_id_map *map, struct ubusd_id *id);
 
-static inline struct ubusd_id *ubusd_find_id(struct avl_tree *tree, uint32_t id)
+static inline struct ubusd_id *ubusd_find_id(struct ubusd_id_map *map, uint32_t id)
 {
+	struct ubusd_id_slot *slot;
 	struct avl_node *avl;
+	uint32_t idx = id & UBUSD_ID_SLOT_MASK;
+
+	if (idx < map->size) {
+		slot = &map->slots[idx];
+		if (slot->val == id && slot->id)
+			return slot->id;
+	}
+
+	if (!map->tree.count)
+		return NULL;
 
-	avl = avl_find(tree, &id);
+	avl = avl_find(&map->tree, &id);
 	if (!avl)
 		return NULL;
 
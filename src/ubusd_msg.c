@@ -4,25 +4,103 @@
 
 struct ubusd_msg_buf *ubusd_msg_ref(struct ubusd_msg_buf *ub)
 {
-	if (ub->refcount == ~0)
-		return ubusd_msg_new(ub->data, ub->len, false);
+	struct ubusd_msg_buf *new_ub;
+
+	if (ub->refcount == ~0) {
+		new_ub = ubusd_msg_new(ub->data, ub->len, false);
+		if (!new_ub)
+			return NULL;
+
+		memcpy(&new_ub->hdr, &ub->hdr, sizeof(ub->hdr));
+		if (ub->tail)
+			new_ub->tail = ubusd_msg_ref(ub->tail);
+		if (ub->fd >= 0)
+			new_ub->fd = dup(ub->fd);
+		return new_ub;
+	}
 
 	ub->refcount++;
 	return ub;
 }
 
-struct ubusd_msg_buf *ubusd_msg_new(void *data, int len, bool shared)
+/*
+ * Message buffers are recycled through per size class free lists, the
+ * payload of a buffer is stored inline right after it. Class 0 holds the
+ * buffers that only point to shared data.
+ */
+static const unsigned int msg_pool_size[] = { 0, 64, 256, 1024, 4096, 16384 };
+static struct ubusd_msg_buf *msg_pool[ARRAY_SIZE(msg_pool_size)];
+
+struct ubusd_msg_stats ubusd_msg_stats;
+
+static int ubusd_msg_pool_class(int len)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(msg_pool_size); i++) {
+		if (len <= msg_pool_size[i])
+			return i;
+	}
+
+	return -1;
+}
+
+static struct ubusd_msg_buf *ubusd_msg_alloc(int len)
 {
 	struct ubusd_msg_buf *ub;
-	int buflen = sizeof(*ub);
+	int pool = ubusd_msg_pool_class(len);
+
+	ubusd_msg_stats.allocs++;
+
+	if (pool >= 0 && msg_pool[pool]) {
+		/* free buffers are chained through their data pointer */
+		ub = msg_pool[pool];
+		msg_pool[pool] = (struct ubusd_msg_buf *) ub->data;
+		ubusd_msg_stats.pool_bytes -= sizeof(*ub) + msg_pool_size[pool];
+		ubusd_msg_stats.pool_hits++;
+	} else {
+		ub = malloc(sizeof(*ub) + (pool >= 0 ? msg_pool_size[pool] : len));
+		if (!ub)
+			return NULL;
+	}
+
+	ub->pool = pool;
+	return ub;
+}
+
+static void ubusd_msg_release(struct ubusd_msg_buf *ub)
+{
+	unsigned int size;
+
+	ubusd_msg_stats.frees++;
 
-	if (!shared)
-		buflen += len;
+	if (ub->pool < 0)
+		goto free;
 
-	ub = calloc(1, buflen);
+	size = sizeof(*ub) + msg_pool_size[ub->pool];
+	if (ubusd_msg_stats.pool_bytes + size > UBUSD_MSG_POOL_LIMIT)
+		goto free;
+
+	ub->data = (void *) msg_pool[ub->pool];
+	msg_pool[ub->pool] = ub;
+	ubusd_msg_stats.pool_bytes += size;
+	return;
+
+free:
+	free(ub);
+}
+
+/* the inline payload is left uninitialized if no data is passed */
+struct ubusd_msg_buf *ubusd_msg_new(void *data, int len, bool shared)
+{
+	struct ubusd_msg_buf *ub;
+
+	ub = ubusd_msg_alloc(shared ? 0 : len);
 	if (!ub)
 		return NULL;
 
+	memset(&ub->hdr, 0, sizeof(ub->hdr));
+	ub->tail = NULL;
 	ub->fd = -1;
 
 	if (shared) {
@@ -39,6 +117,29 @@ struct ubusd_msg_buf *ubusd_msg_new(void *data, int len, bool shared)
 	return ub;
 }
 
+/*
+ * Creates a message that is sent as the payload of base with its first len
+ * bytes replaced by a private copy. Fields that differ per recipient can be
+ * patched in there while all recipients share the rest of the payload.
+ */
+struct ubusd_msg_buf *ubusd_msg_new_patch(struct ubusd_msg_buf *base, int len)
+{
+	struct ubusd_msg_buf *ub;
+
+	ub = ubusd_msg_new(base->data, len, false);
+	if (!ub)
+		return NULL;
+
+	ub->tail = ubusd_msg_ref(base);
+	if (!ub->tail) {
+		ubusd_msg_free(ub);
+		return NULL;
+	}
+
+	memcpy(&ub->hdr, &base->hdr, sizeof(ub->hdr));
+	return ub;
+}
+
 void ubusd_msg_free(struct ubusd_msg_buf *ub)
 {
 	switch (ub->refcount) {
@@ -47,11 +148,13 @@ void ubusd_msg_free(struct ubusd_msg_buf *ub)
 		if (ub->fd >= 0)
 			close(ub->fd);
 
-		free(ub);
+		if (ub->tail)
+			ubusd_msg_free(ub->tail);
+
+		ubusd_msg_release(ub);
 		break;
 	default:
 		ub->refcount--;
 		break;
 	}
 }
-
@@ -0,0 +1,29 @@
+#ifndef __UBUSD_MSG_H
+#define __UBUSD_MSG_H
+
+#include <stdint.h>
+#include <libubus2/libubus2.h>
+
+struct ubusd_msg_buf {
+	uint32_t refcount; /* ~0: uses external data buffer */
+	struct ubus_msghdr hdr;
+	struct blob_attr *data;
+	struct ubusd_msg_buf *tail; /* shared payload, data replaces its first len bytes */
+	int fd;
+	int len;
+	int8_t pool; /* size class the buffer gets recycled to, -1 if none */
+};
+
+struct ubusd_msg_stats {
+	unsigned long allocs;
+	unsigned long pool_hits;
+	unsigned long frees;
+	unsigned long pool_bytes;
+};
+
+extern struct ubusd_msg_stats ubusd_msg_stats;
+
+struct ubusd_msg_buf *ubusd_msg_ref(struct ubusd_msg_buf *ub);
+struct ubusd_msg_buf *ubusd_msg_new_patch(struct ubusd_msg_buf *base, int len);
+
+#endif
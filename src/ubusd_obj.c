@@ -14,9 +14,55 @@
 #include "ubusd.h"
 #include "ubusd_obj.h"
 
-struct avl_tree obj_types;
-struct avl_tree objects;
-struct avl_tree path;
+/* bumped whenever an object is added or removed, lets clients tell
+ * whether their cached lookups are still valid */
+uint32_t ubusd_registry_gen = 1;
+
+struct ubusd_id_map obj_types;
+struct ubusd_id_map objects;
+
+static struct avl_tree obj_signatures;
+
+static uint32_t ubusd_signature_hash(struct blob_attr *sig)
+{
+	const uint8_t *data = (const uint8_t *) sig;
+	unsigned int i, len = blob_attr_raw_len(sig);
+	uint32_t hash = 2166136261u;
+
+	for (i = 0; i < len; i++) {
+		hash ^= data[i];
+		hash *= 16777619;
+	}
+
+	return hash;
+}
+
+static uint32_t ubusd_method_hash(const char *name)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*name) {
+		hash ^= (uint8_t) *name++;
+		hash *= 16777619;
+	}
+
+	return hash;
+}
+
+static int ubusd_cmp_signature(const void *k1, const void *k2, void *ptr)
+{
+	const struct ubusd_type_signature *s1 = k1, *s2 = k2;
+	unsigned int len1 = blob_attr_raw_len(s1->data);
+	unsigned int len2 = blob_attr_raw_len(s2->data);
+
+	if (s1->hash != s2->hash)
+		return s1->hash < s2->hash ? -1 : 1;
+
+	if (len1 != len2)
+		return len1 < len2 ? -1 : 1;
+
+	return memcmp(s1->data, s2->data, len1);
+}
 
 static void ubusd_unref_object_type(struct ubusd_object_type *type)
 {
@@ -31,6 +77,14 @@ static void ubusd_unref_object_type(struct ubusd_object_type *type)
 		free(m);
 	}
 
+	free(type->method_hash);
+	free(type->methods_desc);
+
+	if (type->sig.data) {
+		avl_delete(&obj_signatures, &type->sig_avl);
+		free(type->sig.data);
+	}
+
 	ubusd_free_id(&obj_types, &type->id);
 	free(type);
 }
@@ -46,11 +100,56 @@ static bool ubusd_create_obj_method(struct ubusd_object_type *type, struct blob_
 
 	list_add_tail(&m->list, &type->methods);
 	memcpy(m->data, attr, bloblen);
-	m->name = strdup(blob_attr_get_string(attr));
+	m->name = blob_attr_get_string(m->data);
+	m->hash = ubusd_method_hash(m->name);
+
+	return true;
+}
+
+static bool ubusd_index_obj_methods(struct ubusd_object_type *type)
+{
+	struct ubusd_method *m;
+	unsigned int size = 4, count = 0;
+
+	list_for_each_entry(m, &type->methods, list)
+		count++;
+
+	/* keep the load factor at or below 1/2 */
+	while (size < count * 2)
+		size <<= 1;
+
+	type->method_hash = calloc(size, sizeof(*type->method_hash));
+	if (!type->method_hash)
+		return false;
+
+	type->method_hash_mask = size - 1;
+	list_for_each_entry(m, &type->methods, list) {
+		unsigned int i = m->hash & type->method_hash_mask;
+
+		while (type->method_hash[i])
+			i = (i + 1) & type->method_hash_mask;
+
+		type->method_hash[i] = m;
+	}
 
 	return true;
 }
 
+struct ubusd_method *ubusd_find_method(struct ubusd_object_type *type, const char *name)
+{
+	uint32_t hash = ubusd_method_hash(name);
+	struct ubusd_method *m;
+	unsigned int i;
+
+	for (i = hash & type->method_hash_mask; (m = type->method_hash[i]);
+	     i = (i + 1) & type->method_hash_mask) {
+		if (m->hash == hash && !strcmp(m->name, name))
+			return m;
+	}
+
+	return NULL;
+}
+
 static struct ubusd_object_type *ubusd_create_obj_type(struct blob_attr *sig)
 {
 	struct ubusd_object_type *type;
@@ -66,6 +165,15 @@ static struct ubusd_object_type *ubusd_create_obj_type(struct blob_attr *sig)
 
 	INIT_LIST_HEAD(&type->methods);
 
+	type->sig.hash = ubusd_signature_hash(sig);
+	type->sig.data = malloc(blob_attr_raw_len(sig));
+	if (!type->sig.data)
+		goto error_unref;
+
+	memcpy(type->sig.data, sig, blob_attr_raw_len(sig));
+	type->sig_avl.key = &type->sig;
+	avl_insert(&obj_signatures, &type->sig_avl);
+
 	//blob_for_each_attr(pos, sig, rem) {
 	for(struct blob_attr *pos = blob_attr_first_child(sig); pos; pos = blob_attr_next_child(sig, pos)){
 		//if (!blobmsg_check_attr(pos, true))
@@ -75,6 +183,9 @@ static struct ubusd_object_type *ubusd_create_obj_type(struct blob_attr *sig)
 			goto error_unref;
 	}
 
+	if (!ubusd_index_obj_methods(type))
+		goto error_unref;
+
 	return type;
 
 error_unref:
@@ -100,6 +211,22 @@ static struct ubusd_object_type *ubusd_get_obj_type(uint32_t obj_id)
 	return type;
 }
 
+static struct ubusd_object_type *ubusd_get_obj_type_by_signature(struct blob_attr *sig)
+{
+	struct ubusd_object_type *type;
+	struct ubusd_type_signature key = {
+		.hash = ubusd_signature_hash(sig),
+		.data = sig,
+	};
+
+	type = avl_find_element(&obj_signatures, &key, type, sig_avl);
+	if (!type)
+		return ubusd_create_obj_type(sig);
+
+	type->refcount++;
+	return type;
+}
+
 struct ubusd_object *ubusd_create_object_internal(struct ubusd_object_type *type, uint32_t id)
 {
 	struct ubusd_object *obj;
@@ -141,7 +268,7 @@ struct ubusd_object *ubusd_create_object(struct ubusd_client *cl, struct blob_at
 	if (attr[UBUS_ATTR_OBJTYPE])
 		type = ubusd_get_obj_type(blob_attr_get_u32(attr[UBUS_ATTR_OBJTYPE]));
 	else if (attr[UBUS_ATTR_SIGNATURE])
-		type = ubusd_create_obj_type(attr[UBUS_ATTR_SIGNATURE]);
+		type = ubusd_get_obj_type_by_signature(attr[UBUS_ATTR_SIGNATURE]);
 
 	obj = ubusd_create_object_internal(type, 0);
 	if (type)
@@ -151,20 +278,16 @@ struct ubusd_object *ubusd_create_object(struct ubusd_client *cl, struct blob_at
 		return NULL;
 
 	if (attr[UBUS_ATTR_OBJPATH]) {
-		obj->path.key = strdup(blob_attr_data(attr[UBUS_ATTR_OBJPATH]));
-		if (!obj->path.key)
+		obj->path = ubusd_path_insert(blob_attr_data(attr[UBUS_ATTR_OBJPATH]), obj);
+		if (!obj->path)
 			goto free;
 
-		if (avl_insert(&path, &obj->path) != 0) {
-			free((void *) obj->path.key);
-			obj->path.key = NULL;
-			goto free;
-		}
 		ubusd_send_obj_event(obj, true);
 	}
 
 	obj->client = cl;
 	list_add(&obj->list, &cl->objects);
+	obj->gen = ++ubusd_registry_gen;
 
 	return obj;
 
@@ -173,15 +296,89 @@ free:
 	return NULL;
 }
 
+/*
+ * Subscriptions are indexed by their (subscriber, target) pair in a chained
+ * hash table, which grows with the number of subscriptions.
+ */
+static struct ubusd_subscription **sub_hash;
+static unsigned int sub_hash_size, sub_count;
+
+static unsigned int ubusd_subscription_hash(struct ubusd_object *obj,
+					    struct ubusd_object *target)
+{
+	uint32_t h = obj->id.id * 0x9e3779b1;
+
+	h ^= target->id.id + 0x7f4a7c15 + (h << 6) + (h >> 2);
+	return h & (sub_hash_size - 1);
+}
+
+static bool ubusd_subscription_hash_grow(void)
+{
+	struct ubusd_subscription **old = sub_hash, *s, *next;
+	unsigned int i, old_size = sub_hash_size;
+	unsigned int size = old_size ? old_size * 2 : 64;
+
+	sub_hash = calloc(size, sizeof(*sub_hash));
+	if (!sub_hash) {
+		sub_hash = old;
+		return false;
+	}
+
+	sub_hash_size = size;
+	for (i = 0; i < old_size; i++) {
+		for (s = old[i]; s; s = next) {
+			unsigned int h = ubusd_subscription_hash(s->subscriber, s->target);
+
+			next = s->hash_next;
+			s->hash_next = sub_hash[h];
+			sub_hash[h] = s;
+		}
+	}
+	free(old);
+
+	return true;
+}
+
+struct ubusd_subscription *ubusd_find_subscription(struct ubusd_object *obj,
+						   struct ubusd_object *target)
+{
+	struct ubusd_subscription *s;
+
+	if (!sub_hash_size)
+		return NULL;
+
+	s = sub_hash[ubusd_subscription_hash(obj, target)];
+	for (; s; s = s->hash_next) {
+		if (s->subscriber == obj && s->target == target)
+			return s;
+	}
+
+	return NULL;
+}
+
 void ubusd_subscribe(struct ubusd_object *obj, struct ubusd_object *target)
 {
 	struct ubusd_subscription *s;
 	bool first = list_empty(&target->subscribers);
+	unsigned int h;
+
+	/* subscribing twice does not deliver notifications twice */
+	if (ubusd_find_subscription(obj, target))
+		return;
+
+	if (sub_count >= sub_hash_size && !ubusd_subscription_hash_grow() &&
+	    !sub_hash_size)
+		return;
 
 	s = calloc(1, sizeof(*s));
 	if (!s)
 		return;
 
+	h = ubusd_subscription_hash(obj, target);
+	s->hash_next = sub_hash[h];
+	sub_hash[h] = s;
+	sub_count++;
+
 	s->subscriber = obj;
 	s->target = target;
 	list_add(&s->list, &target->subscribers);
@@ -194,6 +391,13 @@ void ubusd_subscribe(struct ubusd_object *obj, struct ubusd_object *target)
 void ubusd_unsubscribe(struct ubusd_subscription *s)
 {
 	struct ubusd_object *obj = s->target;
+	struct ubusd_subscription **p;
+
+	p = &sub_hash[ubusd_subscription_hash(s->subscriber, s->target)];
+	while (*p != s)
+		p = &(*p)->hash_next;
+	*p = s->hash_next;
+	sub_count--;
 
 	list_del(&s->list);
 	list_del(&s->target_list);
@@ -215,22 +419,26 @@ void ubusd_free_object(struct ubusd_object *obj)
 	}
 
 	ubusd_event_cleanup_object(obj);
-	if (obj->path.key) {
+	if (obj->path) {
 		ubusd_send_obj_event(obj, false);
-		avl_delete(&path, &obj->path);
-		free((void *) obj->path.key);
+		ubusd_path_remove(obj->path);
 	}
-	if (!list_empty(&obj->list))
+	if (!list_empty(&obj->list)) {
 		list_del(&obj->list);
+		ubusd_registry_gen++;
+	}
 	ubusd_free_id(&objects, &obj->id);
 	if (obj->type)
 		ubusd_unref_object_type(obj->type);
+	free(obj->desc);
 	free(obj);
 }
 
 void ubusd_obj_init(void){
-	ubusd_init_id_tree(&objects);
-	ubusd_init_id_tree(&obj_types);
-	ubusd_init_string_tree(&path, false);
+	ubusd_init_id_map(&objects);
+	ubusd_init_id_map(&obj_types);
+	ubusd_path_init();
+	avl_init(&obj_signatures, ubusd_cmp_signature, false, NULL);
 	ubusd_event_init();
+	ubusd_daemon_init();
 }
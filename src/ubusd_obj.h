@@ -16,28 +16,48 @@
 
 #include "ubusd_id.h"
 
-extern struct avl_tree obj_types;
-extern struct avl_tree objects;
-extern struct avl_tree path;
+extern uint32_t ubusd_registry_gen;
+extern struct ubusd_id_map obj_types;
+extern struct ubusd_id_map objects;
 
 struct ubusd_client;
 struct ubusd_msg_buf;
+struct ubusd_path;
+struct ubusd_event_batch;
+
+struct ubusd_type_signature {
+	uint32_t hash;
+	struct blob_attr *data;
+};
 
 struct ubusd_object_type {
 	struct ubusd_id id;
 	int refcount;
 	struct list_head methods;
+
+	/* open addressing hash of the method names */
+	struct ubusd_method **method_hash;
+	unsigned int method_hash_mask;
+
+	/* serialized methods table, built on first lookup */
+	struct blob_attr *methods_desc;
+
+	/* types are shared by all objects with an identical signature */
+	struct avl_node sig_avl;
+	struct ubusd_type_signature sig;
 };
 
 struct ubusd_method {
 	struct list_head list;
-	char *name;
+	uint32_t hash;
+	const char *name;
 	struct blob_attr data[];
 };
 
 struct ubusd_subscription {
 	struct list_head list, target_list;
 	struct ubusd_object *subscriber, *target;
+	struct ubusd_subscription *hash_next;
 };
 
 struct ubusd_object {
@@ -49,18 +69,28 @@ struct ubusd_object {
 	struct list_head subscribers, target_list;
 
 	struct ubusd_object_type *type;
-	struct avl_node path;
+	struct ubusd_path *path;
 
 	struct ubusd_client *client;
-	int (*recv_msg)(struct ubusd_client *client, const char *method, struct blob_attr *msg);
+	int (*recv_msg)(struct ubusd_client *client, struct ubusd_msg_buf *ub,
+			const char *method, struct blob_attr *msg);
 
 	int event_seen;
+	struct ubusd_event_batch *event_batch;
 	unsigned int invoke_seq;
+
+	/* registry generation at which the object was added */
+	uint32_t gen;
+
+	/* serialized lookup reply, built on first lookup. Objects do not
+	 * change after registration, so it lives as long as the object */
+	struct blob_attr *desc;
 };
 
 struct ubusd_object *ubusd_create_object(struct ubusd_client *cl, struct blob_attr **attr);
 struct ubusd_object *ubusd_create_object_internal(struct ubusd_object_type *type, uint32_t id);
 void ubusd_free_object(struct ubusd_object *obj);
+struct ubusd_method *ubusd_find_method(struct ubusd_object_type *type, const char *name);
 
 static inline struct ubusd_object *ubusd_find_object(uint32_t objid)
 {
@@ -75,6 +105,8 @@ static inline struct ubusd_object *ubusd_find_object(uint32_t objid)
 	return obj;
 }
 
+struct ubusd_subscription *ubusd_find_subscription(struct ubusd_object *obj,
+						   struct ubusd_object *target);
 void ubusd_subscribe(struct ubusd_object *obj, struct ubusd_object *target);
 void ubusd_unsubscribe(struct ubusd_subscription *s);
 void ubusd_notify_unsubscribe(struct ubusd_subscription *s);
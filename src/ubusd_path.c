@@ -0,0 +1,312 @@
+#include "ubusd.h"
+
+static struct ubusd_path path_root;
+
+static int ubusd_path_cmp(const void *k1, const void *k2, void *ptr)
+{
+	const struct ubusd_path_key *key1 = k1, *key2 = k2;
+	int ret;
+
+	ret = memcmp(key1->name, key2->name, key1->len < key2->len ? key1->len : key2->len);
+	if (ret)
+		return ret;
+
+	return key1->len - key2->len;
+}
+
+/* returns the first segment of @name, and the rest of it in @next */
+static void ubusd_path_segment(const char *name, struct ubusd_path_key *key, const char **next)
+{
+	const char *sep = strchr(name, '.');
+
+	key->name = name;
+	key->len = sep ? sep - name : strlen(name);
+	*next = sep ? sep + 1 : NULL;
+}
+
+static struct ubusd_path *ubusd_path_child(struct ubusd_path *node, struct ubusd_path_key *key)
+{
+	struct ubusd_path *child;
+
+	return avl_find_element(&node->children, key, child, avl);
+}
+
+static struct ubusd_path *ubusd_path_new(struct ubusd_path *parent, struct ubusd_path_key *key)
+{
+	struct ubusd_path *node;
+
+	node = calloc(1, sizeof(*node) + key->len + 1);
+	if (!node)
+		return NULL;
+
+	memcpy(node->name, key->name, key->len);
+	node->key.name = node->name;
+	node->key.len = key->len;
+	node->avl.key = &node->key;
+	node->parent = parent;
+	node->len = key->len;
+	if (parent != &path_root)
+		node->len += parent->len + 1;
+
+	avl_init(&node->children, ubusd_path_cmp, false, NULL);
+	avl_insert(&parent->children, &node->avl);
+	return node;
+}
+
+/* frees the nodes that neither carry an object nor lead to one */
+static void ubusd_path_prune(struct ubusd_path *node)
+{
+	struct ubusd_path *parent;
+
+	while (node != &path_root && !node->obj && !node->children.count) {
+		parent = node->parent;
+		avl_delete(&parent->children, &node->avl);
+		free(node);
+		node = parent;
+	}
+}
+
+struct ubusd_path *ubusd_path_insert(const char *name, struct ubusd_object *obj)
+{
+	struct ubusd_path *node = &path_root, *child;
+	struct ubusd_path_key key;
+
+	while (name) {
+		ubusd_path_segment(name, &key, &name);
+
+		child = ubusd_path_child(node, &key);
+		if (!child)
+			child = ubusd_path_new(node, &key);
+		if (!child)
+			goto error;
+
+		node = child;
+	}
+
+	if (node->obj)
+		return NULL;
+
+	node->obj = obj;
+	return node;
+
+error:
+	ubusd_path_prune(node);
+	return NULL;
+}
+
+void ubusd_path_remove(struct ubusd_path *node)
+{
+	node->obj = NULL;
+	ubusd_path_prune(node);
+}
+
+struct ubusd_object *ubusd_path_find(const char *name)
+{
+	struct ubusd_path *node = &path_root;
+	struct ubusd_path_key key;
+
+	while (name && node) {
+		ubusd_path_segment(name, &key, &name);
+		node = ubusd_path_child(node, &key);
+	}
+
+	return node ? node->obj : NULL;
+}
+
+struct ubusd_path_iter {
+	ubusd_path_cb cb;
+	void *priv;
+	int count;
+	bool stop;
+};
+
+static void ubusd_path_report(struct ubusd_path_iter *it, struct ubusd_object *obj)
+{
+	if (!it->cb(obj, it->priv)) {
+		it->stop = true;
+		return;
+	}
+
+	it->count++;
+}
+
+/*
+ * Compares @child with the segment of the cursor @after on its level.
+ * Returns < 0 if the whole subtree sorts before the cursor, > 0 if it sorts
+ * after it and 0 if it is on the cursor path. In the last case @child
+ * itself is not reported and the rest of the cursor is returned in
+ * @child_after.
+ */
+static int ubusd_path_cursor(struct ubusd_path *child, const char *after, const char **child_after)
+{
+	struct ubusd_path_key key;
+	const char *next;
+	int cmp;
+
+	*child_after = NULL;
+	if (!after)
+		return 1;
+
+	ubusd_path_segment(after, &key, &next);
+	cmp = ubusd_path_cmp(&child->key, &key, NULL);
+	if (!cmp)
+		*child_after = next;
+
+	return cmp;
+}
+
+static struct ubusd_path *ubusd_path_first(struct ubusd_path *node, const char *after)
+{
+	struct ubusd_path *child;
+	struct ubusd_path_key key;
+	const char *next;
+
+	if (!node->children.count)
+		return NULL;
+
+	if (!after)
+		return avl_first_element(&node->children, child, avl);
+
+	ubusd_path_segment(after, &key, &next);
+	return avl_find_ge_element(&node->children, &key, child, avl);
+}
+
+static struct ubusd_path *ubusd_path_next(struct ubusd_path *node, struct ubusd_path *child)
+{
+	struct ubusd_path *last = avl_last_element(&node->children, last, avl);
+
+	if (child == last)
+		return NULL;
+
+	return avl_next_element(child, avl);
+}
+
+static void ubusd_path_walk(struct ubusd_path *node, const char *after, bool skip_self,
+			    struct ubusd_path_iter *it)
+{
+	struct ubusd_path *child;
+	const char *child_after;
+	int cmp;
+
+	if (node->obj && !skip_self)
+		ubusd_path_report(it, node->obj);
+
+	for (child = ubusd_path_first(node, after); child && !it->stop;
+	     child = ubusd_path_next(node, child)) {
+		cmp = ubusd_path_cursor(child, after, &child_after);
+		if (cmp < 0)
+			continue;
+
+		ubusd_path_walk(child, child_after, !cmp, it);
+	}
+}
+
+static void ubusd_path_match(struct ubusd_path *node, const char *pattern, const char *after,
+			     struct ubusd_path_iter *it)
+{
+	struct ubusd_path *child;
+	struct ubusd_path_key key;
+	const char *next, *child_after;
+	int cmp;
+
+	ubusd_path_segment(pattern, &key, &next);
+
+	/* a trailing '*' matches everything starting with the pattern */
+	if (!next && key.len && key.name[key.len - 1] == '*') {
+		if (!node->children.count)
+			return;
+
+		key.len--;
+		child = avl_find_ge_element(&node->children, &key, child, avl);
+		for (; child && !it->stop; child = ubusd_path_next(node, child)) {
+			if (child->key.len < key.len || memcmp(child->name, key.name, key.len))
+				break;
+
+			cmp = ubusd_path_cursor(child, after, &child_after);
+			if (cmp < 0)
+				continue;
+
+			ubusd_path_walk(child, child_after, !cmp, it);
+		}
+
+		return;
+	}
+
+	/* a '*' segment in the middle matches exactly one segment */
+	if (key.len == 1 && key.name[0] == '*') {
+		for (child = ubusd_path_first(node, after); child && !it->stop;
+		     child = ubusd_path_next(node, child)) {
+			cmp = ubusd_path_cursor(child, after, &child_after);
+			if (cmp < 0)
+				continue;
+
+			ubusd_path_match(child, next, child_after, it);
+		}
+
+		return;
+	}
+
+	child = ubusd_path_child(node, &key);
+	if (!child)
+		return;
+
+	cmp = ubusd_path_cursor(child, after, &child_after);
+	if (cmp < 0)
+		return;
+
+	if (next)
+		ubusd_path_match(child, next, child_after, it);
+	else if (child->obj && cmp > 0)
+		ubusd_path_report(it, child->obj);
+}
+
+/*
+ * Calls @cb for every object matching @pattern in path order and returns
+ * their number, until @cb returns false. Besides exact paths, the pattern
+ * can end in '*' to match every path starting with it and use '*' in
+ * place of a single segment. If @after is set, only objects sorting after
+ * that path are reported, which allows resuming a lookup.
+ */
+int ubusd_path_lookup(const char *pattern, const char *after, ubusd_path_cb cb, void *priv)
+{
+	struct ubusd_path_iter it = {
+		.cb = cb,
+		.priv = priv,
+	};
+
+	ubusd_path_match(&path_root, pattern, after, &it);
+	return it.count;
+}
+
+/* the returned string is only valid until the next call */
+const char *ubusd_path_name(struct ubusd_path *node)
+{
+	static char *buf;
+	static unsigned int buflen;
+	char *pos;
+
+	if (node->len + 1 > buflen) {
+		pos = realloc(buf, node->len + 1);
+		if (!pos)
+			return "";
+
+		buf = pos;
+		buflen = node->len + 1;
+	}
+
+	pos = buf + node->len;
+	*pos = 0;
+	for (; node != &path_root; node = node->parent) {
+		pos -= node->key.len;
+		memcpy(pos, node->name, node->key.len);
+		if (node->parent != &path_root)
+			*--pos = '.';
+	}
+
+	return buf;
+}
+
+void ubusd_path_init(void)
+{
+	avl_init(&path_root.children, ubusd_path_cmp, false, NULL);
+}
@@ -0,0 +1,36 @@
+#ifndef __UBUSD_PATH_H
+#define __UBUSD_PATH_H
+
+#include <libutype/avl.h>
+
+struct ubusd_object;
+
+struct ubusd_path_key {
+	const char *name;
+	int len;
+};
+
+/*
+ * Object paths are kept in a trie with one node per dot separated path
+ * segment, so common prefixes like "network.interface" are stored once.
+ */
+struct ubusd_path {
+	struct avl_node avl;
+	struct ubusd_path_key key;
+	struct avl_tree children;
+	struct ubusd_path *parent;
+	struct ubusd_object *obj;
+	unsigned int len;	/* length of the full path */
+	char name[];
+};
+
+typedef bool (*ubusd_path_cb)(struct ubusd_object *obj, void *priv);
+
+void ubusd_path_init(void);
+struct ubusd_path *ubusd_path_insert(const char *name, struct ubusd_object *obj);
+void ubusd_path_remove(struct ubusd_path *node);
+struct ubusd_object *ubusd_path_find(const char *name);
+int ubusd_path_lookup(const char *pattern, const char *after, ubusd_path_cb cb, void *priv);
+const char *ubusd_path_name(struct ubusd_path *node);
+
+#endif
@@ -17,8 +17,9 @@
 #include "ubusd.h"
 
 static struct ubusd_msg_buf *retmsg;
+static struct blob_buf desc_buf;
 static int *retmsg_data;
-static struct avl_tree clients;
+struct ubusd_id_map clients;
 
 typedef int (*ubusd_cmd_cb)(struct ubusd_client *cl, struct ubusd_msg_buf *ub, struct blob_attr **attr);
 
@@ -65,9 +66,8 @@ static struct ubusd_msg_buf *ubusd_reply_from_blob(struct ubusd_msg_buf *ub, boo
 	return new;
 }
 
-static void
-ubusd_send_msg_from_blob(struct ubusd_client *cl, struct ubusd_msg_buf *ub,
-			uint8_t type)
+void ubusd_send_msg_from_blob(struct ubusd_client *cl, struct ubusd_msg_buf *ub,
+			      uint8_t type)
 {
 	ub = ubusd_reply_from_blob(ub, true);
 	if (!ub)
@@ -142,81 +142,135 @@ static int ubusd_handle_add_object(struct ubusd_client *cl, struct ubusd_msg_buf
 	return 0;
 }
 
-static void ubusd_send_obj(struct ubusd_client *cl, struct ubusd_msg_buf *ub, struct ubusd_object *obj)
+static struct blob_attr *ubusd_copy_attr(struct blob_attr *attr)
+{
+	struct blob_attr *copy;
+
+	copy = malloc(blob_attr_raw_len(attr));
+	if (copy)
+		memcpy(copy, attr, blob_attr_raw_len(attr));
+
+	return copy;
+}
+
+static struct blob_attr *ubusd_type_desc(struct ubusd_object_type *type)
 {
 	struct ubusd_method *m;
 	void *s;
 
-	blob_buf_reset(&b);
+	if (type->methods_desc)
+		return type->methods_desc;
+
+	blob_buf_reset(&desc_buf);
+	s = blob_buf_open_table(&desc_buf);
+	list_for_each_entry(m, &type->methods, list)
+		blob_buf_put_attr(&desc_buf, m->data);
+	blob_buf_close_table(&desc_buf, s);
+
+	type->methods_desc = ubusd_copy_attr(blob_attr_first_child(blob_buf_head(&desc_buf)));
+	return type->methods_desc;
+}
+
+/* returns the lookup reply for @obj, encoding it only the first time */
+static struct blob_attr *ubusd_obj_desc(struct ubusd_object *obj)
+{
+	struct blob_attr *methods = NULL;
 
-	blob_offset_t tbl = blob_buf_open_table(&b); 
-		blob_buf_put_string(&b, "id"); 
-		blob_buf_put_i32(&b, obj->id.id);
-		blob_buf_put_string(&b, "client"); 
-		blob_buf_put_i32(&b, obj->client->id.id); 
+	if (obj->desc)
+		return obj->desc;
 
-		if (obj->path.key) {
-			blob_buf_put_string(&b, "path"); 
-			blob_buf_put_string(&b, obj->path.key);
+	if (obj->type) {
+		methods = ubusd_type_desc(obj->type);
+		if (!methods)
+			return NULL;
+	}
+
+	blob_buf_reset(&desc_buf);
+
+	blob_offset_t tbl = blob_buf_open_table(&desc_buf); 
+		blob_buf_put_string(&desc_buf, "id"); 
+		blob_buf_put_i32(&desc_buf, obj->id.id);
+		blob_buf_put_string(&desc_buf, "client"); 
+		blob_buf_put_i32(&desc_buf, obj->client->id.id); 
+		blob_buf_put_string(&desc_buf, "generation"); 
+		blob_buf_put_u32(&desc_buf, obj->gen); 
+
+		if (obj->path) {
+			blob_buf_put_string(&desc_buf, "path"); 
+			blob_buf_put_string(&desc_buf, ubusd_path_name(obj->path));
 		}
-		blob_buf_put_string(&b, "type"); 
-		blob_buf_put_i32(&b, obj->type->id.id);
-		
-		blob_buf_put_string(&b, "methods"); 
-		s = blob_buf_open_table(&b);
-		list_for_each_entry(m, &obj->type->methods, list)
-			blob_buf_put_attr(&b, m->data);
-		blob_buf_close_table(&b, s);
-	blob_buf_close_table(&b, tbl); 
 
-	ubusd_send_msg_from_blob(cl, ub, UBUS_MSG_DATA);
+		if (obj->type) {
+			blob_buf_put_string(&desc_buf, "type"); 
+			blob_buf_put_i32(&desc_buf, obj->type->id.id);
+
+			blob_buf_put_string(&desc_buf, "methods"); 
+			blob_buf_put_attr(&desc_buf, methods);
+		}
+	blob_buf_close_table(&desc_buf, tbl); 
+
+	obj->desc = ubusd_copy_attr(blob_buf_head(&desc_buf));
+	return obj->desc;
 }
 
-static int ubusd_handle_lookup(struct ubusd_client *cl, struct ubusd_msg_buf *ub, struct blob_attr **attr)
+/* appends the descriptor table of @obj as sent in lookup replies to @buf */
+void ubusd_put_obj(struct blob_buf *buf, struct ubusd_object *obj)
 {
-	struct ubusd_object *obj;
-	char *objpath;
-	bool found = false;
-	int len;
+	struct blob_attr *desc = ubusd_obj_desc(obj);
 
-	if (!attr[UBUS_ATTR_OBJPATH]) {
-		avl_for_each_element(&path, obj, path)
-			ubusd_send_obj(cl, ub, obj);
-		return 0;
-	}
+	if (desc)
+		blob_buf_put_attr(buf, blob_attr_first_child(desc));
+}
+
+static void ubusd_send_obj(struct ubusd_client *cl, struct ubusd_msg_buf *ub, struct ubusd_object *obj)
+{
+	struct blob_attr *desc = ubusd_obj_desc(obj);
+	struct ubusd_msg_buf *new;
 
-	objpath = blob_attr_data(attr[UBUS_ATTR_OBJPATH]);
-	len = strlen(objpath);
-	if (objpath[len - 1] != '*') {
-		obj = avl_find_element(&path, objpath, obj, path);
-		if (!obj)
-			return UBUS_STATUS_NOT_FOUND;
+	if (!desc)
+		return;
 
-		ubusd_send_obj(cl, ub, obj);
-		return 0;
-	}
+	new = ubusd_msg_new(desc, blob_attr_raw_len(desc), true);
+	if (!new)
+		return;
 
-	objpath[--len] = 0;
+	ubusd_msg_init(new, UBUS_MSG_DATA, ub->hdr.seq, ub->hdr.peer);
+	ubusd_msg_send(cl, new, true);
+}
 
-	obj = avl_find_ge_element(&path, objpath, obj, path);
-	if (!obj)
-		return UBUS_STATUS_NOT_FOUND;
+struct ubusd_lookup_req {
+	struct ubusd_client *cl;
+	struct ubusd_msg_buf *ub;
+};
+
+static bool ubusd_lookup_send_obj(struct ubusd_object *obj, void *priv)
+{
+	struct ubusd_lookup_req *req = priv;
+
+	ubusd_send_obj(req->cl, req->ub, obj);
+	return true;
+}
 
-	while (!strncmp(objpath, obj->path.key, len)) {
-		found = true;
-		ubusd_send_obj(cl, ub, obj);
-		if (obj == avl_last_element(&path, obj, path))
-			break;
-		obj = avl_next_element(obj, path);
+static int ubusd_handle_lookup(struct ubusd_client *cl, struct ubusd_msg_buf *ub, struct blob_attr **attr)
+{
+	struct ubusd_lookup_req req = {
+		.cl = cl,
+		.ub = ub,
+	};
+
+	if (!attr[UBUS_ATTR_OBJPATH]) {
+		ubusd_path_lookup("*", NULL, ubusd_lookup_send_obj, &req);
+		return 0;
 	}
 
-	if (!found)
+	if (!ubusd_path_lookup(blob_attr_data(attr[UBUS_ATTR_OBJPATH]), NULL,
+			       ubusd_lookup_send_obj, &req))
 		return UBUS_STATUS_NOT_FOUND;
 
 	return 0;
 }
 
-static void
+static bool
 ubusd_forward_invoke(struct ubusd_object *obj, const char *method,
 		     struct ubusd_msg_buf *ub, struct blob_attr *data)
 {
@@ -225,32 +279,101 @@ ubusd_forward_invoke(struct ubusd_object *obj, const char *method,
 	if (data)
 		blob_buf_put_attr(&b, data);
 
-	ubusd_send_msg_from_blob(obj->client, ub, UBUS_MSG_INVOKE);
+	ub = ubusd_reply_from_blob(ub, true);
+	if (!ub)
+		return false;
+
+	ub->hdr.type = UBUS_MSG_INVOKE;
+	ubusd_msg_send(obj->client, ub, true);
+	return true;
+}
+
+/*
+ * The target of an invoke can be given by path instead of by id, either as
+ * UBUS_ATTR_OBJPATH or as a string in place of the id. This saves callers
+ * the lookup round-trip.
+ *
+ * A client that caches lookups can pass the target as an array of the id
+ * or path and the registry generation its cache is based on. The call then
+ * fails with UBUS_STATUS_NOT_FOUND if the target was registered after that
+ * generation, i.e. if the cached entry no longer describes it. A third
+ * element sets a deadline in ms after which the daemon answers the call
+ * with UBUS_STATUS_TIMEOUT, a generation of 0 skips the check.
+ */
+static struct ubusd_object *ubusd_invoke_target(struct blob_attr **attr, int *timeout)
+{
+	struct blob_attr *target = attr[UBUS_ATTR_OBJID];
+	struct blob_attr *gen = NULL, *deadline = NULL;
+	struct ubusd_object *obj;
+
+	*timeout = 0;
+
+	if (attr[UBUS_ATTR_OBJPATH])
+		return ubusd_path_find(blob_attr_data(attr[UBUS_ATTR_OBJPATH]));
+
+	if (blob_attr_type(target) == BLOB_ATTR_ARRAY) {
+		target = blob_attr_first_child(attr[UBUS_ATTR_OBJID]);
+		if (!target)
+			return NULL;
+
+		gen = blob_attr_next_child(attr[UBUS_ATTR_OBJID], target);
+		if (gen && blob_attr_type(gen) != BLOB_ATTR_INT32)
+			return NULL;
+
+		if (gen)
+			deadline = blob_attr_next_child(attr[UBUS_ATTR_OBJID], gen);
+		if (deadline && blob_attr_type(deadline) != BLOB_ATTR_INT32)
+			return NULL;
+	}
+
+	if (blob_attr_type(target) == BLOB_ATTR_STRING)
+		obj = ubusd_path_find(blob_attr_data(target));
+	else
+		obj = ubusd_find_object(blob_attr_get_u32(target));
+
+	if (obj && gen && blob_attr_get_u32(gen) &&
+	    obj->gen > blob_attr_get_u32(gen))
+		return NULL;
+
+	if (deadline)
+		*timeout = blob_attr_get_i32(deadline);
+
+	return obj;
 }
 
 static int ubusd_handle_invoke(struct ubusd_client *cl, struct ubusd_msg_buf *ub, struct blob_attr **attr)
 {
 	struct ubusd_object *obj = NULL;
-	struct ubusd_id *id;
 	const char *method;
+	int timeout, ret;
 
-	if (!attr[UBUS_ATTR_METHOD] || !attr[UBUS_ATTR_OBJID])
+	if (!attr[UBUS_ATTR_METHOD] || (!attr[UBUS_ATTR_OBJID] && !attr[UBUS_ATTR_OBJPATH]))
 		return UBUS_STATUS_INVALID_ARGUMENT;
 
-	id = ubusd_find_id(&objects, blob_attr_get_u32(attr[UBUS_ATTR_OBJID]));
-	if (!id)
+	obj = ubusd_invoke_target(attr, &timeout);
+	if (!obj)
 		return UBUS_STATUS_NOT_FOUND;
 
-	obj = container_of(id, struct ubusd_object, id);
-
 	method = blob_attr_data(attr[UBUS_ATTR_METHOD]);
 
 	if (!obj->client)
-		return obj->recv_msg(cl, method, attr[UBUS_ATTR_DATA]);
+		return obj->recv_msg(cl, ub, method, attr[UBUS_ATTR_DATA]);
+
+	/* do not bother the provider with calls it cannot handle */
+	if (obj->type && !ubusd_find_method(obj->type, method))
+		return UBUS_STATUS_METHOD_NOT_FOUND;
+
+	ret = ubusd_request_add(cl, obj, ub->hdr.seq, timeout);
+	if (ret)
+		return ret;
 
 	ub->hdr.peer = cl->id.id;
 	blob_buf_reset(&b);
-	ubusd_forward_invoke(obj, method, ub, attr[UBUS_ATTR_DATA]);
+	if (!ubusd_forward_invoke(obj, method, ub, attr[UBUS_ATTR_DATA])) {
+		ubusd_request_cancel(cl, ub->hdr.seq);
+		return UBUS_STATUS_NO_DATA;
+	}
+
 	ubusd_msg_free(ub);
 
 	return -1;
@@ -260,9 +383,12 @@ static int ubusd_handle_notify(struct ubusd_client *cl, struct ubusd_msg_buf *ub
 {
 	struct ubusd_object *obj = NULL;
 	struct ubusd_subscription *s;
+	struct ubusd_msg_buf *notify;
+	struct blob_attr *objid;
 	struct ubusd_id *id;
 	const char *method;
 	bool no_reply = false;
+	int objid_ofs, prefix_len;
 	void *c;
 
 	if (!attr[UBUS_ATTR_METHOD] || !attr[UBUS_ATTR_OBJID])
@@ -291,14 +417,49 @@ static int ubusd_handle_notify(struct ubusd_client *cl, struct ubusd_msg_buf *ub
 		ubusd_send_msg_from_blob(cl, ub, UBUS_MSG_STATUS);
 	}
 
+	if (list_empty(&obj->subscribers))
+		goto out;
+
+	/*
+	 * The notification is encoded once, every subscriber gets a private
+	 * copy of the message start only, with its object id patched in.
+	 */
 	ub->hdr.peer = cl->id.id;
 	method = blob_attr_data(attr[UBUS_ATTR_METHOD]);
+	blob_buf_reset(&b);
+	if (no_reply)
+		blob_buf_put_i8(&b, 1);
+	blob_buf_put_i32(&b, 0);
+	blob_buf_put_string(&b, method);
+	if (attr[UBUS_ATTR_DATA])
+		blob_buf_put_attr(&b, attr[UBUS_ATTR_DATA]);
+
+	notify = ubusd_reply_from_blob(ub, false);
+	if (!notify)
+		goto out;
+
+	notify->hdr.type = UBUS_MSG_INVOKE;
+	objid = blob_attr_first_child(notify->data);
+	if (no_reply)
+		objid = blob_attr_next_child(notify->data, objid);
+
+	objid_ofs = (char *) blob_attr_data(objid) - (char *) notify->data;
+	prefix_len = (char *) objid - (char *) notify->data + blob_attr_pad_len(objid);
+
 	list_for_each_entry(s, &obj->subscribers, list) {
-		blob_buf_reset(&b);
-		if (no_reply)
-			blob_buf_put_i8(&b, 1);
-		ubusd_forward_invoke(s->subscriber, method, ub, attr[UBUS_ATTR_DATA]);
+		struct ubusd_msg_buf *msg = ubusd_msg_new_patch(notify, prefix_len);
+		uint32_t *objid_ptr;
+
+		if (!msg)
+			continue;
+
+		objid_ptr = (uint32_t *) ((char *) msg->data + objid_ofs);
+		*objid_ptr = htonl(s->subscriber->id.id);
+		ubusd_msg_send(s->subscriber->client, msg, true);
 	}
+	ubusd_msg_free(notify);
+
+out:
 	ubusd_msg_free(ub);
 
 	return -1;
@@ -317,6 +478,7 @@ static struct ubusd_client *ubusd_get_client_by_id(uint32_t id)
 
 static int ubusd_handle_response(struct ubusd_client *cl, struct ubusd_msg_buf *ub, struct blob_attr **attr)
 {
+	struct ubusd_client *caller;
 	struct ubusd_object *obj;
 
 	if (!attr[UBUS_ATTR_OBJID] ||
@@ -331,12 +493,28 @@ static int ubusd_handle_response(struct ubusd_client *cl, struct ubusd_msg_buf *
 	if (cl != obj->client)
 		goto error;
 
-	cl = ubusd_get_client_by_id(ub->hdr.peer);
-	if (!cl)
+	/* responses to invokes the daemon forwarded for a batch */
+	if (ub->hdr.peer == UBUSD_SYSTEM_OBJECT_DAEMON) {
+		if (ub->hdr.type == UBUS_MSG_STATUS)
+			ubusd_request_internal_response(ub->hdr.seq, cl, NULL,
+							blob_attr_get_u32(attr[UBUS_ATTR_STATUS]));
+		else
+			ubusd_request_internal_response(ub->hdr.seq, cl,
+							attr[UBUS_ATTR_DATA], 0);
+		ubusd_msg_free(ub);
+		return -1;
+	}
+
+	caller = ubusd_get_client_by_id(ub->hdr.peer);
+	if (!caller)
+		goto error;
+
+	if (!ubusd_request_response(caller, ub->hdr.seq, cl,
+				    ub->hdr.type == UBUS_MSG_STATUS))
 		goto error;
 
 	ub->hdr.peer = blob_attr_get_u32(attr[UBUS_ATTR_OBJID]);
-	ubusd_msg_send(cl, ub, true);
+	ubusd_msg_send(caller, ub, true);
 	return -1;
 
 error:
@@ -371,9 +549,8 @@ static int ubusd_handle_add_watch(struct ubusd_client *cl, struct ubusd_msg_buf
 
 static int ubusd_handle_remove_watch(struct ubusd_client *cl, struct ubusd_msg_buf *ub, struct blob_attr **attr)
 {
-	struct ubusd_object *obj;
+	struct ubusd_object *obj, *target;
 	struct ubusd_subscription *s;
-	uint32_t id;
 
 	if (!attr[UBUS_ATTR_OBJID] || !attr[UBUS_ATTR_TARGET])
 		return UBUS_STATUS_INVALID_ARGUMENT;
@@ -385,16 +562,16 @@ static int ubusd_handle_remove_watch(struct ubusd_client *cl, struct ubusd_msg_b
 	if (cl != obj->client)
 		return UBUS_STATUS_INVALID_ARGUMENT;
 
-	id = blob_attr_get_u32(attr[UBUS_ATTR_TARGET]);
-	list_for_each_entry(s, &obj->target_list, target_list) {
-		if (s->target->id.id != id)
-			continue;
+	target = ubusd_find_object(blob_attr_get_u32(attr[UBUS_ATTR_TARGET]));
+	if (!target)
+		return UBUS_STATUS_NOT_FOUND;
 
-		ubusd_unsubscribe(s);
-		return 0;
-	}
+	s = ubusd_find_subscription(obj, target);
+	if (!s)
+		return UBUS_STATUS_NOT_FOUND;
 
-	return UBUS_STATUS_NOT_FOUND;
+	ubusd_unsubscribe(s);
+	return 0;
 }
 
 static const ubusd_cmd_cb handlers[__UBUS_MSG_LAST] = {
@@ -410,9 +587,136 @@ static const ubusd_cmd_cb handlers[__UBUS_MSG_LAST] = {
 	[UBUS_MSG_NOTIFY] = ubusd_handle_notify,
 };
 
+/*
+ * Returns the attribute at pos if it lies completely within the message,
+ * NULL otherwise. Only the attribute headers up to pos are looked at.
+ */
+static struct blob_attr *ubusd_msg_peek_attr(struct ubusd_msg_buf *ub, char *pos)
+{
+	char *end = (char *) ub->data + ub->len;
+	struct blob_attr *attr = (struct blob_attr *) pos;
+
+	if (pos + sizeof(*attr) > end ||
+	    blob_attr_raw_len(attr) < sizeof(*attr) ||
+	    pos + blob_attr_raw_len(attr) > end)
+		return NULL;
+
+	return attr;
+}
+
+static bool ubusd_msg_peek(struct ubusd_msg_buf *ub, struct blob_attr **first,
+			   struct blob_attr **second)
+{
+	if (ub->len < sizeof(struct blob_attr) || blob_attr_raw_len(ub->data) != ub->len)
+		return false;
+
+	*first = ubusd_msg_peek_attr(ub, blob_attr_data(ub->data));
+	if (!*first)
+		return false;
+
+	*second = ubusd_msg_peek_attr(ub, (char *) *first + blob_attr_pad_len(*first));
+	return *second != NULL;
+}
+
+/*
+ * An invoke of a method known to be provided by a client object has the
+ * same layout as the message the provider gets, so it is forwarded as it
+ * came in with just the peer rewritten. Anything else is left to the full
+ * parser and ubusd_handle_invoke.
+ */
+static bool ubusd_fast_invoke(struct ubusd_client *cl, struct ubusd_msg_buf *ub)
+{
+	struct blob_attr *objid, *method;
+	struct ubusd_object *obj;
+	const char *name;
+	int len;
+
+	if (!ubusd_msg_peek(ub, &objid, &method))
+		return false;
+
+	if (blob_attr_type(objid) != BLOB_ATTR_INT32 ||
+	    blob_attr_type(method) != BLOB_ATTR_STRING)
+		return false;
+
+	name = blob_attr_data(method);
+	len = blob_attr_len(method);
+	if (!len || name[len - 1])
+		return false;
+
+	obj = ubusd_find_object(blob_attr_get_u32(objid));
+	if (!obj || !obj->client)
+		return false;
+
+	if (!obj->type || !ubusd_find_method(obj->type, name))
+		return false;
+
+	if (ubusd_request_add(cl, obj, ub->hdr.seq, 0))
+		return false;
+
+	ubusd_msg_close_fd(ub);
+	ub->hdr.peer = cl->id.id;
+	ubusd_msg_send(obj->client, ub, true);
+
+	return true;
+}
+
+/*
+ * Responses that have the layout ubusd_handle_response expects only need
+ * their object id checked before being passed on.
+ */
+static bool ubusd_fast_response(struct ubusd_client *cl, struct ubusd_msg_buf *ub)
+{
+	struct blob_attr *objid, *arg;
+	struct ubusd_object *obj;
+	struct ubusd_client *caller;
+
+	if (!ubusd_msg_peek(ub, &objid, &arg))
+		return false;
+
+	if (blob_attr_type(objid) != BLOB_ATTR_INT32 ||
+	    (ub->hdr.type == UBUS_MSG_STATUS && blob_attr_type(arg) != BLOB_ATTR_INT32) ||
+	    (ub->hdr.type == UBUS_MSG_DATA && blob_attr_type(arg) != BLOB_ATTR_TABLE))
+		return false;
+
+	obj = ubusd_find_object(blob_attr_get_u32(objid));
+	if (!obj || obj->client != cl)
+		return false;
+
+	caller = ubusd_get_client_by_id(ub->hdr.peer);
+	if (!caller)
+		return false;
+
+	if (ub->hdr.type != UBUS_MSG_STATUS)
+		ubusd_msg_close_fd(ub);
+
+	/* a dropped response is still handled, the parser would drop it too */
+	if (!ubusd_request_response(caller, ub->hdr.seq, cl,
+				    ub->hdr.type == UBUS_MSG_STATUS)) {
+		ubusd_msg_free(ub);
+		return true;
+	}
+
+	ub->hdr.peer = obj->id.id;
+	ubusd_msg_send(caller, ub, true);
+
+	return true;
+}
+
+/*
+ * Runs the handler for the type of a message on its parsed attributes.
+ * Returns -1 if the handler took over the message, a status otherwise.
+ */
+int ubusd_proto_dispatch(struct ubusd_client *cl, struct ubusd_msg_buf *ub,
+			 struct blob_attr **attr)
+{
+	if (ub->hdr.type >= __UBUS_MSG_LAST || !handlers[ub->hdr.type])
+		return UBUS_STATUS_INVALID_COMMAND;
+
+	return handlers[ub->hdr.type](cl, ub, attr);
+}
+
 void ubusd_proto_receive_message(struct ubusd_client *cl, struct ubusd_msg_buf *ub)
 {
-	ubusd_cmd_cb cb = NULL;
 	int ret;
 
 	retmsg->hdr.seq = ub->hdr.seq;
@@ -421,8 +725,17 @@ void ubusd_proto_receive_message(struct ubusd_client *cl, struct ubusd_msg_buf *
 	printf("IN %s seq=%d peer=%08x: ", ubus_message_types[ub->hdr.type], ub->hdr.seq, ub->hdr.peer);
 	blob_attr_dump_json(ub->data); 
 
-	if (ub->hdr.type < __UBUS_MSG_LAST)
-		cb = handlers[ub->hdr.type];
+	switch (ub->hdr.type) {
+	case UBUS_MSG_INVOKE:
+		if (ubusd_fast_invoke(cl, ub))
+			return;
+		break;
+	case UBUS_MSG_DATA:
+	case UBUS_MSG_STATUS:
+		if (ubusd_fast_response(cl, ub))
+			return;
+		break;
+	}
 
 	if (ub->hdr.type != UBUS_MSG_STATUS)
 		ubusd_msg_close_fd(ub);
@@ -432,11 +745,7 @@ void ubusd_proto_receive_message(struct ubusd_client *cl, struct ubusd_msg_buf *
 	
 	ubus_message_parse(ub->hdr.type, ub->data, attrbuf); 
 
-	if (cb)
-		ret = cb(cl, ub, attrbuf);
-	else
-		ret = UBUS_STATUS_INVALID_COMMAND;
-
+	ret = ubusd_proto_dispatch(cl, ub, attrbuf);
 	if (ret == -1)
 		return;
 
@@ -472,6 +781,10 @@ void ubusd_proto_free_client(struct ubusd_client *cl)
 {
 	struct ubusd_object *obj;
 
+	ubusd_daemon_cleanup_client(cl);
+	ubusd_request_cleanup_client(cl);
+	ubusd_event_cleanup_client(cl);
+
 	while (!list_empty(&cl->objects)) {
 		obj = list_first_entry(&cl->objects, struct ubusd_object, list);
 		ubusd_free_object(obj);
@@ -516,7 +829,9 @@ void ubusd_notify_unsubscribe(struct ubusd_subscription *s)
 
 void ubusd_proto_init(void)
 {
-	ubusd_init_id_tree(&clients);
+	ubusd_init_id_map(&clients);
+	blob_buf_init(&desc_buf, 0, 0);
+	ubusd_request_init();
 
 	blob_buf_reset(&b);
 	blob_buf_put_i32(&b, 0);
@@ -0,0 +1,361 @@
+/*
+ * Invokes forwarded to clients are tracked until the callee sends the final
+ * status, so that callers can be answered right away when the callee goes
+ * away or the deadline they asked for passes. A request that timed out stays
+ * around as expired until the callee answers, so that its late responses are
+ * dropped instead of reaching the caller.
+ *
+ * Nothing is tracked forever: invokes without a deadline and expired entries
+ * are forgotten silently after UBUSD_REQUEST_TIMEOUT.
+ *
+ * The daemon forwards invokes of its own on behalf of batches. Those are sent
+ * with the daemon object as the peer and a sequence number of the daemon, so
+ * they never collide with the requests of a client, and their responses go
+ * to a callback instead of a caller.
+ */
+#include <arpa/inet.h>
+#include "ubusd.h"
+
+struct ubusd_request_key {
+	uint32_t caller;
+	uint16_t seq;
+};
+
+struct ubusd_request {
+	struct avl_node avl;
+	struct ubusd_request_key key;
+
+	struct list_head caller_list, callee_list;
+	struct ubusd_client *caller, *callee;
+	uint32_t objid;
+
+	/* set for invokes of the daemon, which have no caller */
+	ubusd_request_cb cb;
+	void *priv;
+
+	/* deadlines are kept in a timer wheel, expires counts ticks */
+	struct list_head wheel_list;
+	uint32_t expires;
+	bool deadline; /* the caller asked to be answered on timeout */
+	bool expired;
+};
+
+static struct avl_tree requests;
+static uint16_t internal_seq;
+
+static struct list_head wheel[UBUSD_REQUEST_WHEEL_SIZE];
+static struct uloop_timeout wheel_timer;
+static uint32_t wheel_tick;
+static unsigned int wheel_count;
+
+static int ubusd_request_cmp(const void *k1, const void *k2, void *ptr)
+{
+	const struct ubusd_request_key *r1 = k1, *r2 = k2;
+
+	if (r1->caller != r2->caller)
+		return r1->caller < r2->caller ? -1 : 1;
+
+	return r1->seq - r2->seq;
+}
+
+static void ubusd_request_clear_deadline(struct ubusd_request *req)
+{
+	if (list_empty(&req->wheel_list))
+		return;
+
+	list_del_init(&req->wheel_list);
+	wheel_count--;
+}
+
+static void ubusd_request_free(struct ubusd_request *req)
+{
+	ubusd_request_clear_deadline(req);
+	avl_delete(&requests, &req->avl);
+	list_del(&req->caller_list);
+	list_del(&req->callee_list);
+	if (req->caller)
+		req->caller->n_requests--;
+	free(req);
+}
+
+/* hands the final status of an invoke of the daemon to its callback */
+static void ubusd_request_finish(struct ubusd_request *req, int status)
+{
+	ubusd_request_cb cb = req->cb;
+	void *priv = req->priv;
+
+	ubusd_request_free(req);
+	cb(priv, NULL, status);
+}
+
+/* answers the caller in place of the callee */
+static void ubusd_request_reply(struct ubusd_request *req, int status)
+{
+	struct ubusd_msg_buf *ub;
+
+	blob_buf_reset(&b);
+	blob_buf_put_i32(&b, req->objid);
+	blob_buf_put_i32(&b, status);
+
+	ub = ubusd_msg_new(blob_buf_head(&b), blob_buf_size(&b), false);
+	if (ub) {
+		ub->hdr.type = UBUS_MSG_STATUS;
+		ub->hdr.seq = req->key.seq;
+		ub->hdr.peer = req->objid;
+		ubusd_msg_send(req->caller, ub, true);
+	}
+}
+
+static void ubusd_request_set_deadline(struct ubusd_request *req, int timeout);
+
+static void ubusd_request_expire(struct ubusd_request *req)
+{
+	ubusd_request_reply(req, UBUS_STATUS_TIMEOUT);
+	ubusd_request_clear_deadline(req);
+	ubusd_request_set_deadline(req, UBUSD_REQUEST_TIMEOUT);
+	req->expired = true;
+}
+
+static void ubusd_request_wheel_cb(struct uloop_timeout *t)
+{
+	struct ubusd_request *req, *tmp;
+	struct list_head *slot;
+
+	wheel_tick++;
+	slot = &wheel[wheel_tick % UBUSD_REQUEST_WHEEL_SIZE];
+
+	/* entries more than one round ahead share the slot */
+	list_for_each_entry_safe(req, tmp, slot, wheel_list) {
+		if (req->expires != wheel_tick)
+			continue;
+
+		if (req->cb)
+			ubusd_request_finish(req, UBUS_STATUS_TIMEOUT);
+		else if (req->deadline && !req->expired)
+			ubusd_request_expire(req);
+		else
+			ubusd_request_free(req);
+	}
+
+	if (wheel_count)
+		uloop_timeout_set(&uloop, &wheel_timer, UBUSD_REQUEST_TICK);
+}
+
+static void ubusd_request_set_deadline(struct ubusd_request *req, int timeout)
+{
+	uint32_t ticks = (timeout + UBUSD_REQUEST_TICK - 1) / UBUSD_REQUEST_TICK;
+
+	if (!ticks)
+		ticks = 1;
+
+	req->expires = wheel_tick + ticks;
+	list_add_tail(&req->wheel_list, &wheel[req->expires % UBUSD_REQUEST_WHEEL_SIZE]);
+
+	if (!wheel_count++)
+		uloop_timeout_set(&uloop, &wheel_timer, UBUSD_REQUEST_TICK);
+}
+
+/*
+ * Returns a status if the caller has too many invokes in flight and the
+ * invoke should be refused.
+ */
+int ubusd_request_add(struct ubusd_client *caller, struct ubusd_object *obj,
+		      uint16_t seq, int timeout)
+{
+	struct ubusd_request_key key = {
+		.caller = caller->id.id,
+		.seq = seq,
+	};
+	struct ubusd_request *req;
+
+	/* a caller reusing a sequence number has given up on the old request */
+	req = avl_find_element(&requests, &key, req, avl);
+	if (req)
+		ubusd_request_free(req);
+
+	if (caller->n_requests >= UBUSD_CLIENT_MAX_REQUESTS)
+		return UBUS_STATUS_UNKNOWN_ERROR;
+
+	req = calloc(1, sizeof(*req));
+	if (!req)
+		return UBUS_STATUS_NO_DATA;
+
+	req->key = key;
+	req->avl.key = &req->key;
+	avl_insert(&requests, &req->avl);
+
+	caller->n_requests++;
+	req->caller = caller;
+	req->callee = obj->client;
+	req->objid = obj->id.id;
+	list_add_tail(&req->caller_list, &caller->requests);
+	list_add_tail(&req->callee_list, &obj->client->pending);
+
+	INIT_LIST_HEAD(&req->wheel_list);
+	if (timeout > 0) {
+		req->deadline = true;
+		ubusd_request_set_deadline(req, timeout);
+	} else {
+		ubusd_request_set_deadline(req, UBUSD_REQUEST_TIMEOUT);
+	}
+
+	return 0;
+}
+
+/* forgets a request that could not be forwarded */
+void ubusd_request_cancel(struct ubusd_client *caller, uint16_t seq)
+{
+	struct ubusd_request_key key = {
+		.caller = caller->id.id,
+		.seq = seq,
+	};
+	struct ubusd_request *req;
+
+	req = avl_find_element(&requests, &key, req, avl);
+	if (req)
+		ubusd_request_free(req);
+}
+
+/*
+ * Called for every response a callee sends, final for the status. Returns
+ * false if the response must be dropped: it belongs to a request of another
+ * callee, or the caller already got a timeout for it.
+ */
+bool ubusd_request_response(struct ubusd_client *caller, uint16_t seq,
+			    struct ubusd_client *callee, bool final)
+{
+	struct ubusd_request_key key = {
+		.caller = caller->id.id,
+		.seq = seq,
+	};
+	struct ubusd_request *req;
+	bool expired;
+
+	req = avl_find_element(&requests, &key, req, avl);
+	if (!req)
+		return true;
+
+	if (req->callee != callee)
+		return false;
+
+	expired = req->expired;
+	if (final)
+		ubusd_request_free(req);
+
+	return !expired;
+}
+
+void ubusd_request_cleanup_client(struct ubusd_client *cl)
+{
+	struct ubusd_request *req;
+
+	while (!list_empty(&cl->pending)) {
+		req = list_first_entry(&cl->pending, struct ubusd_request, callee_list);
+		if (req->cb) {
+			ubusd_request_finish(req, UBUS_STATUS_NO_DATA);
+			continue;
+		}
+
+		if (req->caller != cl && !req->expired)
+			ubusd_request_reply(req, UBUS_STATUS_NO_DATA);
+		ubusd_request_free(req);
+	}
+
+	while (!list_empty(&cl->requests)) {
+		req = list_first_entry(&cl->requests, struct ubusd_request, caller_list);
+		ubusd_request_free(req);
+	}
+}
+
+/*
+ * Tracks an invoke the daemon forwards itself and returns the sequence
+ * number to send it with, or -1 if it cannot be tracked. The callback also
+ * gets UBUS_STATUS_TIMEOUT once the timeout passes and UBUS_STATUS_NO_DATA
+ * if the callee goes away.
+ */
+int ubusd_request_add_internal(struct ubusd_object *obj, int timeout,
+			       ubusd_request_cb cb, void *priv)
+{
+	struct ubusd_request_key key = {
+		.caller = UBUSD_SYSTEM_OBJECT_DAEMON,
+	};
+	struct ubusd_request *req;
+	int i;
+
+	for (i = 0; i <= UINT16_MAX; i++) {
+		key.seq = internal_seq++;
+		if (!avl_find(&requests, &key))
+			break;
+	}
+
+	if (i > UINT16_MAX)
+		return -1;
+
+	req = calloc(1, sizeof(*req));
+	if (!req)
+		return -1;
+
+	req->key = key;
+	req->avl.key = &req->key;
+	avl_insert(&requests, &req->avl);
+
+	req->callee = obj->client;
+	req->objid = obj->id.id;
+	req->cb = cb;
+	req->priv = priv;
+	INIT_LIST_HEAD(&req->caller_list);
+	list_add_tail(&req->callee_list, &obj->client->pending);
+
+	INIT_LIST_HEAD(&req->wheel_list);
+	ubusd_request_set_deadline(req, timeout > 0 ? timeout : UBUSD_REQUEST_TIMEOUT);
+
+	return key.seq;
+}
+
+/* forgets an invoke of the daemon without calling its callback */
+void ubusd_request_cancel_internal(uint16_t seq)
+{
+	struct ubusd_request_key key = {
+		.caller = UBUSD_SYSTEM_OBJECT_DAEMON,
+		.seq = seq,
+	};
+	struct ubusd_request *req;
+
+	req = avl_find_element(&requests, &key, req, avl);
+	if (req)
+		ubusd_request_free(req);
+}
+
+/*
+ * Called for responses sent to the daemon itself, data for DATA and NULL
+ * with the status for STATUS. Responses without a request are dropped.
+ */
+void ubusd_request_internal_response(uint16_t seq, struct ubusd_client *callee,
+				     struct blob_attr *data, int status)
+{
+	struct ubusd_request_key key = {
+		.caller = UBUSD_SYSTEM_OBJECT_DAEMON,
+		.seq = seq,
+	};
+	struct ubusd_request *req;
+
+	req = avl_find_element(&requests, &key, req, avl);
+	if (!req || req->callee != callee)
+		return;
+
+	if (data)
+		req->cb(req->priv, data, 0);
+	else
+		ubusd_request_finish(req, status);
+}
+
+void ubusd_request_init(void)
+{
+	int i;
+
+	avl_init(&requests, ubusd_request_cmp, false, NULL);
+	for (i = 0; i < UBUSD_REQUEST_WHEEL_SIZE; i++)
+		INIT_LIST_HEAD(&wheel[i]);
+
+	wheel_timer.cb = ubusd_request_wheel_cb;
+}
@@ -0,0 +1,28 @@
+#ifndef __UBUSD_REQUEST_H
+#define __UBUSD_REQUEST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct blob_attr;
+struct ubusd_client;
+struct ubusd_object;
+
+/* gets the data of every DATA response, then NULL and the final status */
+typedef void (*ubusd_request_cb)(void *priv, struct blob_attr *data, int status);
+
+void ubusd_request_init(void);
+int ubusd_request_add(struct ubusd_client *caller, struct ubusd_object *obj,
+		      uint16_t seq, int timeout);
+void ubusd_request_cancel(struct ubusd_client *caller, uint16_t seq);
+bool ubusd_request_response(struct ubusd_client *caller, uint16_t seq,
+			    struct ubusd_client *callee, bool final);
+void ubusd_request_cleanup_client(struct ubusd_client *cl);
+
+int ubusd_request_add_internal(struct ubusd_object *obj, int timeout,
+			       ubusd_request_cb cb, void *priv);
+void ubusd_request_cancel_internal(uint16_t seq);
+void ubusd_request_internal_response(uint16_t seq, struct ubusd_client *callee,
+				     struct blob_attr *data, int status);
+
+#endif
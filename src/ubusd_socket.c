@@ -5,14 +5,57 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
 
 #include "ubusd.h"
 
+#ifndef IOV_MAX
+#define IOV_MAX	1024
+#endif
+
 static void _socket_cb(struct uloop_fd *sock, unsigned int events); 
 
+/* a message goes out as its header, its data and the rest of a shared tail */
+#define UBUSD_MSG_IOV	3
+
+static unsigned int ubusd_msg_size(struct ubusd_msg_buf *ub)
+{
+	return sizeof(ub->hdr) + (ub->tail ? ub->tail->len : ub->len);
+}
+
+/* fills in the iovecs for the part of a message after offset */
+static int ubusd_msg_fill_iov(struct ubusd_msg_buf *ub, unsigned int offset,
+			      struct iovec *iov)
+{
+	struct iovec part[UBUSD_MSG_IOV] = {
+		{ &ub->hdr, sizeof(ub->hdr) },
+		{ ub->data, ub->len },
+		{ NULL, 0 },
+	};
+	int i, n = 0;
+
+	if (ub->tail) {
+		part[2].iov_base = (char *) ub->tail->data + ub->len;
+		part[2].iov_len = ub->tail->len - ub->len;
+	}
+
+	for (i = 0; i < UBUSD_MSG_IOV; i++) {
+		if (offset >= part[i].iov_len) {
+			offset -= part[i].iov_len;
+			continue;
+		}
+
+		iov[n].iov_base = (char *) part[i].iov_base + offset;
+		iov[n++].iov_len = part[i].iov_len - offset;
+		offset = 0;
+	}
+
+	return n;
+}
+
 static int ubusd_msg_writev(int fd, struct ubusd_msg_buf *ub, int offset)
 {
-	static struct iovec iov[2];
+	static struct iovec iov[UBUSD_MSG_IOV];
 	static struct {
 		struct cmsghdr h;
 		int fd;
@@ -25,42 +68,154 @@ static int ubusd_msg_writev(int fd, struct ubusd_msg_buf *ub, int offset)
 	};
 	struct msghdr msghdr = {
 		.msg_iov = iov,
-		.msg_iovlen = ARRAY_SIZE(iov),
 		.msg_control = &fd_buf,
 		.msg_controllen = sizeof(fd_buf),
 	};
 
 	fd_buf.fd = ub->fd;
-	if (ub->fd < 0) {
+	if (ub->fd < 0 || offset) {
 		msghdr.msg_control = NULL;
 		msghdr.msg_controllen = 0;
 	}
 
-	if (offset < sizeof(ub->hdr)) {
-		iov[0].iov_base = ((char *) &ub->hdr) + offset;
-		iov[0].iov_len = sizeof(ub->hdr) - offset;
-		iov[1].iov_base = (char *) ub->data;
-		iov[1].iov_len = ub->len;
+	msghdr.msg_iovlen = ubusd_msg_fill_iov(ub, offset, iov);
+	return sendmsg(fd, &msghdr, 0);
+}
 
-		return sendmsg(fd, &msghdr, 0);
-	} else {
-		offset -= sizeof(ub->hdr);
-		return write(fd, ((char *) ub->data) + offset, ub->len - offset);
+static struct ubusd_msg_buf *ubusd_msg_head(struct ubusd_client *cl)
+{
+	if (!cl->txq_size)
+		return NULL;
+
+	return cl->tx_queue[cl->txq_cur];
+}
+
+/* events are the only messages that can be dropped without breaking a
+ * request/reply exchange */
+static bool ubusd_msg_is_event(struct ubusd_msg_buf *ub)
+{
+	return ub->hdr.type == UBUS_MSG_INVOKE && !ub->hdr.peer;
+}
+
+/* replies to requests the client made itself */
+static bool ubusd_msg_is_reply(struct ubusd_msg_buf *ub)
+{
+	return ub->hdr.type == UBUS_MSG_DATA || ub->hdr.type == UBUS_MSG_STATUS;
+}
+
+static bool ubusd_msg_grow_queue(struct ubusd_client *cl)
+{
+	unsigned int size = cl->txq_size ? cl->txq_size * 2 : UBUSD_CLIENT_BACKLOG;
+	struct ubusd_msg_buf **queue;
+	unsigned int i, n = 0;
+
+	queue = calloc(size, sizeof(*queue));
+	if (!queue)
+		return false;
+
+	for (i = 0; i < cl->txq_size; i++) {
+		struct ubusd_msg_buf *ub = cl->tx_queue[(cl->txq_cur + i) % cl->txq_size];
+
+		if (!ub)
+			break;
+
+		queue[n++] = ub;
 	}
+
+	free(cl->tx_queue);
+	cl->tx_queue = queue;
+	cl->txq_size = size;
+	cl->txq_cur = 0;
+	cl->txq_tail = n;
+	return true;
 }
 
-static void ubusd_msg_enqueue(struct ubusd_client *cl, struct ubusd_msg_buf *ub)
+/* drops queued events, oldest first, until @len more bytes fit */
+static void ubusd_msg_drop_events(struct ubusd_client *cl, unsigned int len)
 {
-	if (cl->tx_queue[cl->txq_tail])
-		return;
+	struct ubusd_msg_buf *ub;
+	unsigned int i, kept = 0;
+	unsigned int r = cl->txq_cur, w = cl->txq_cur;
+
+	for (i = 0; i < cl->txq_size && (ub = cl->tx_queue[r]); i++) {
+		bool partial = r == cl->txq_cur && cl->txq_ofs;
+
+		r = (r + 1) % cl->txq_size;
+
+		if (cl->txq_bytes + len > cl->txq_limit &&
+		    ubusd_msg_is_event(ub) && !partial) {
+			cl->txq_bytes -= ubusd_msg_size(ub);
+			cl->txq_dropped++;
+			ubusd_msg_free(ub);
+			continue;
+		}
 
-	cl->tx_queue[cl->txq_tail] = ubusd_msg_ref(ub);
-	cl->txq_tail = (cl->txq_tail + 1) % ARRAY_SIZE(cl->tx_queue);
+		cl->tx_queue[w] = ub;
+		w = (w + 1) % cl->txq_size;
+		kept++;
+	}
+
+	cl->txq_tail = w;
+	for (; kept < i; kept++) {
+		cl->tx_queue[w] = NULL;
+		w = (w + 1) % cl->txq_size;
+	}
 }
 
-static struct ubusd_msg_buf *ubusd_msg_head(struct ubusd_client *cl)
+static void ubusd_msg_enqueue(struct ubusd_client *cl, struct ubusd_msg_buf *ub)
 {
-	return cl->tx_queue[cl->txq_cur];
+	unsigned int len = ubusd_msg_size(ub);
+
+	/* a single message always fits, so that nobody starves */
+	if (ubusd_msg_head(cl) && cl->txq_bytes + len > cl->txq_limit) {
+		switch (cl->txq_policy) {
+		case UBUSD_TXQ_DROP_EVENTS:
+			ubusd_msg_drop_events(cl, len);
+			if (cl->txq_bytes + len <= cl->txq_limit || !ubusd_msg_is_event(ub))
+				break;
+
+			cl->txq_dropped++;
+			return;
+		case UBUSD_TXQ_DISCONNECT:
+			goto disconnect;
+		default:
+			/*
+			 * Blocking stops the requests of the client itself, so
+			 * their replies are always queued. Messages pushed by
+			 * others are bounded by a hard limit.
+			 */
+			if (ubusd_msg_is_reply(ub) ||
+			    cl->txq_bytes + len <= cl->txq_limit * UBUSD_CLIENT_TXQ_HARD_FACTOR)
+				break;
+
+			if (!ubusd_msg_is_event(ub))
+				goto disconnect;
+
+			cl->txq_dropped++;
+			return;
+		}
+	}
+
+	if ((!cl->txq_size || cl->tx_queue[cl->txq_tail]) && !ubusd_msg_grow_queue(cl))
+		goto drop;
+
+	ub = ubusd_msg_ref(ub);
+	if (!ub)
+		goto drop;
+
+	cl->tx_queue[cl->txq_tail] = ub;
+	cl->txq_tail = (cl->txq_tail + 1) % cl->txq_size;
+
+	cl->txq_bytes += len;
+	if (cl->txq_bytes > cl->txq_high_water)
+		cl->txq_high_water = cl->txq_bytes;
+	return;
+
+disconnect:
+	/* the next write fails and tears down the client */
+	shutdown(cl->sock.fd, SHUT_RDWR);
+drop:
+	cl->txq_dropped++;
 }
 
 static void ubusd_msg_dequeue(struct ubusd_client *cl)
@@ -70,10 +225,87 @@ static void ubusd_msg_dequeue(struct ubusd_client *cl)
 	if (!ub)
 		return;
 
+	cl->txq_bytes -= ubusd_msg_size(ub);
 	ubusd_msg_free(ub);
 	cl->txq_ofs = 0;
 	cl->tx_queue[cl->txq_cur] = NULL;
-	cl->txq_cur = (cl->txq_cur + 1) % ARRAY_SIZE(cl->tx_queue);
+	cl->txq_cur = (cl->txq_cur + 1) % cl->txq_size;
+}
+
+/*
+ * Sends as much of the tx queue as possible with a single sendmsg. A message
+ * carrying an fd is always sent in a call of its own, so that the receiver
+ * gets the fd together with the start of the right frame. Returns 1 if all
+ * gathered messages were written, 0 on a short write and -1 on error.
+ */
+static int ubusd_msg_flush(struct ubusd_client *cl)
+{
+	static struct iovec iov[IOV_MAX];
+	static struct {
+		struct cmsghdr h;
+		int fd;
+	} fd_buf = {
+		.h = {
+			.cmsg_len = sizeof(fd_buf),
+			.cmsg_level = SOL_SOCKET,
+			.cmsg_type = SCM_RIGHTS,
+		},
+	};
+	struct msghdr msghdr = {
+		.msg_iov = iov,
+	};
+	struct ubusd_msg_buf *ub;
+	unsigned int idx = cl->txq_cur;
+	unsigned int offset = cl->txq_ofs;
+	int count = 0, niov = 0, total = 0, written;
+
+	while (count < cl->txq_size && (ub = cl->tx_queue[idx]) &&
+	       niov + UBUSD_MSG_IOV <= ARRAY_SIZE(iov)) {
+		if (ub->fd >= 0 && niov)
+			break;
+
+		niov += ubusd_msg_fill_iov(ub, offset, &iov[niov]);
+		total += ubusd_msg_size(ub) - offset;
+
+		idx = (idx + 1) % cl->txq_size;
+		offset = 0;
+		count++;
+
+		if (ub->fd >= 0) {
+			/* the fd went out with the first part already */
+			if (!cl->txq_ofs) {
+				fd_buf.fd = ub->fd;
+				msghdr.msg_control = &fd_buf;
+				msghdr.msg_controllen = sizeof(fd_buf);
+			}
+			break;
+		}
+	}
+
+	msghdr.msg_iovlen = niov;
+	written = sendmsg(cl->sock.fd, &msghdr, 0);
+	if (written < 0)
+		return -1;
+
+	if (written < total) {
+		while ((ub = ubusd_msg_head(cl))) {
+			unsigned int left = ubusd_msg_size(ub) - cl->txq_ofs;
+
+			if (written < left) {
+				cl->txq_ofs += written;
+				break;
+			}
+
+			written -= left;
+			ubusd_msg_dequeue(cl);
+		}
+		return 0;
+	}
+
+	while (count--)
+		ubusd_msg_dequeue(cl);
+
+	return 1;
 }
 
 /* takes the msgbuf reference */
@@ -81,11 +313,15 @@ void ubusd_msg_send(struct ubusd_client *cl, struct ubusd_msg_buf *ub, bool free
 	int written;
 
 	printf("OUT %s seq=%d peer=%08x: ", ubus_message_types[ub->hdr.type], ub->hdr.seq, ub->hdr.peer);
-	blob_attr_dump_json(ub->data); 
+	/* the root attribute of a message with a tail spans both buffers */
+	if (!ub->tail)
+		blob_attr_dump_json(ub->data);
+	else
+		printf("\n");
 
-	if (!cl->tx_queue[cl->txq_cur]) {
+	if (!ubusd_msg_head(cl)) {
 		written = ubusd_msg_writev(cl->sock.fd, ub, 0);
-		if (written >= ub->len + sizeof(ub->hdr))
+		if (written >= (int) ubusd_msg_size(ub))
 			goto out;
 
 		if (written < 0)
@@ -111,12 +347,76 @@ void ubusd_socket_init(struct ubusd_client *self, int fd){
 void ubusd_socket_destroy(struct ubusd_client *self){
 	while (ubusd_msg_head(self))
 		ubusd_msg_dequeue(self);
+
+	free(self->tx_queue);
+	self->tx_queue = NULL;
+	self->txq_size = 0;
+
+	free(self->rx_buf);
+	self->rx_buf = NULL;
+	self->rx_size = self->rx_ofs = self->rx_len = 0;
 }
 
-static void _socket_cb(struct uloop_fd *sock, unsigned int events){
-	struct ubusd_client *cl = container_of(sock, struct ubusd_client, sock);
-	struct ubusd_msg_buf *ub;
-	static struct iovec iov; 
+#define UBUSD_FRAME_HDR_LEN	(sizeof(struct ubus_msghdr) + sizeof(struct blob_attr))
+
+/*
+ * Returns the length of the frame at the head of the receive buffer, 0 if
+ * its header has not been received completely yet and -1 if it is invalid.
+ */
+static int ubusd_socket_rx_frame_len(struct ubusd_client *cl)
+{
+	struct blob_attr attr;
+
+	if (cl->rx_len - cl->rx_ofs < UBUSD_FRAME_HDR_LEN)
+		return 0;
+
+	memcpy(&attr, cl->rx_buf + cl->rx_ofs + sizeof(struct ubus_msghdr), sizeof(attr));
+	if (blob_attr_raw_len(&attr) < sizeof(attr) ||
+	    blob_attr_pad_len(&attr) > UBUS_MAX_MSGLEN)
+		return -1;
+
+	return sizeof(struct ubus_msghdr) + blob_attr_raw_len(&attr);
+}
+
+/*
+ * Makes room for at least @need bytes counted from the start of the
+ * partially received frame. The partial frame is moved to the front of
+ * the buffer so that every read can fill the remaining space.
+ */
+static bool ubusd_socket_rx_reserve(struct ubusd_client *cl, unsigned int need)
+{
+	unsigned int avail = cl->rx_len - cl->rx_ofs;
+	unsigned int size = UBUSD_CLIENT_RX_BUFSIZE;
+	char *buf;
+
+	if (cl->rx_ofs) {
+		if (avail)
+			memmove(cl->rx_buf, cl->rx_buf + cl->rx_ofs, avail);
+		if (cl->pending_msg_fd >= 0)
+			cl->pending_msg_fd_ofs -= cl->rx_ofs;
+		cl->rx_ofs = 0;
+		cl->rx_len = avail;
+	}
+
+	if (need > size)
+		size = need;
+
+	/* drop the extra space needed by an oversized frame once it is gone */
+	if (cl->rx_buf && (size == cl->rx_size || (size < cl->rx_size && avail)))
+		return true;
+
+	buf = realloc(cl->rx_buf, size);
+	if (!buf)
+		return false;
+
+	cl->rx_buf = buf;
+	cl->rx_size = size;
+	return true;
+}
+
+static int ubusd_socket_recv(struct ubusd_client *cl, unsigned int limit)
+{
+	static struct iovec iov;
 	static struct {
 		struct cmsghdr h;
 		int fd;
@@ -131,13 +431,81 @@ static void _socket_cb(struct uloop_fd *sock, unsigned int events){
 		.msg_iov = &iov,
 		.msg_iovlen = 1,
 	};
+	int bytes;
+
+	fd_buf.fd = -1;
+
+	iov.iov_base = cl->rx_buf + cl->rx_len;
+	iov.iov_len = cl->rx_size - cl->rx_len;
+
+	if (cl->pending_msg_fd < 0) {
+		msghdr.msg_control = &fd_buf;
+		msghdr.msg_controllen = sizeof(fd_buf);
+	} else {
+		/* do not read past the frame that owns the pending fd, the
+		 * kernel would drop any further fd attached to the stream */
+		if (iov.iov_len > limit)
+			iov.iov_len = limit;
+		msghdr.msg_control = NULL;
+		msghdr.msg_controllen = 0;
+	}
+
+	bytes = recvmsg(cl->sock.fd, &msghdr, 0);
+	if (bytes <= 0)
+		return bytes;
+
+	/*
+	 * The kernel ends a read after the data carrying an fd, so the fd
+	 * belongs to the frame that contains the last byte we received.
+	 */
+	if (fd_buf.fd >= 0) {
+		cl->pending_msg_fd = fd_buf.fd;
+		cl->pending_msg_fd_ofs = cl->rx_len + bytes - 1;
+	}
+
+	cl->rx_len += bytes;
+	return bytes;
+}
+
+static bool ubusd_socket_rx_frame(struct ubusd_client *cl, int len)
+{
+	char *frame = cl->rx_buf + cl->rx_ofs;
+	struct blob_attr *data = (struct blob_attr *) (frame + sizeof(struct ubus_msghdr));
+	int datalen = len - sizeof(struct ubus_msghdr);
+	struct ubusd_msg_buf *ub;
+
+	/*
+	 * Hand the payload to the message handler in place, the buffer is not
+	 * touched until the handler returns and anything that has to outlive
+	 * it gets copied by ubusd_msg_ref. Frames following an unpadded one can
+	 * end up misaligned, those get copied here already.
+	 */
+	ub = ubusd_msg_new(data, datalen, !((unsigned long) data & 3));
+	if (!ub)
+		return false;
+
+	memcpy(&ub->hdr, frame, sizeof(ub->hdr));
+
+	if (cl->pending_msg_fd >= 0 && cl->pending_msg_fd_ofs < cl->rx_ofs + len) {
+		ub->fd = cl->pending_msg_fd;
+		cl->pending_msg_fd = -1;
+	}
+
+	cl->rx_ofs += len;
+	if (cl->on_message)
+		cl->on_message(cl, ub);
+
+	return true;
+}
+
+static void _socket_cb(struct uloop_fd *sock, unsigned int events){
+	struct ubusd_client *cl = container_of(sock, struct ubusd_client, sock);
 
 	/* first try to tx more pending data */
-	while ((ub = ubusd_msg_head(cl))) {
-		int written;
+	while (ubusd_msg_head(cl)) {
+		int ret = ubusd_msg_flush(cl);
 
-		written = ubusd_msg_writev(sock->fd, ub, cl->txq_ofs);
-		if (written < 0) {
+		if (ret < 0) {
 			switch(errno) {
 			case EINTR:
 			case EAGAIN:
@@ -148,11 +516,8 @@ static void _socket_cb(struct uloop_fd *sock, unsigned int events){
 			break;
 		}
 
-		cl->txq_ofs += written;
-		if (cl->txq_ofs < ub->len + sizeof(ub->hdr))
+		if (!ret)
 			break;
-
-		ubusd_msg_dequeue(cl);
 	}
 
 	/* prevent further ULOOP_WRITE events if we don't have data
@@ -160,76 +525,44 @@ static void _socket_cb(struct uloop_fd *sock, unsigned int events){
 	if (!ubusd_msg_head(cl) && (events & ULOOP_WRITE))
 		uloop_add_fd(&cl->uloop, sock, ULOOP_READ | ULOOP_EDGE_TRIGGER);
 
-retry:
-	if (!sock->eof && cl->pending_msg_offset < sizeof(cl->hdrbuf)) {
-		int offset = cl->pending_msg_offset;
+	/* dispatch every complete frame, then read as much as fits */
+	for (;;) {
+		int len;
+		unsigned int need;
 		int bytes;
 
-		fd_buf.fd = -1;
+		/*
+		 * push back on clients that do not read their replies, checked
+		 * for every frame since a single one can queue a lot of them
+		 */
+		if (cl->txq_policy == UBUSD_TXQ_BLOCK && cl->txq_bytes > cl->txq_limit)
+			return;
 
-		iov.iov_base = &cl->hdrbuf + offset;
-		iov.iov_len = sizeof(cl->hdrbuf) - offset;
+		len = ubusd_socket_rx_frame_len(cl);
+		if (len < 0)
+			goto disconnect;
 
-		if (cl->pending_msg_fd < 0) {
-			msghdr.msg_control = &fd_buf;
-			msghdr.msg_controllen = sizeof(fd_buf);
-		} else {
-			msghdr.msg_control = NULL;
-			msghdr.msg_controllen = 0;
+		if (len > 0 && cl->rx_len - cl->rx_ofs >= len) {
+			if (!ubusd_socket_rx_frame(cl, len))
+				goto disconnect;
+			continue;
 		}
 
-		bytes = recvmsg(sock->fd, &msghdr, 0);
-		if (bytes < 0)
-			goto out;
-
-		if (fd_buf.fd >= 0)
-			cl->pending_msg_fd = fd_buf.fd;
-
-		cl->pending_msg_offset += bytes;
-		if (cl->pending_msg_offset < sizeof(cl->hdrbuf))
-			goto out;
-
-		if (blob_attr_pad_len(&cl->hdrbuf.data) > UBUS_MAX_MSGLEN)
+		need = len ? len : UBUSD_FRAME_HDR_LEN;
+		if (!ubusd_socket_rx_reserve(cl, need))
 			goto disconnect;
 
-		cl->pending_msg = ubusd_msg_new(NULL, blob_attr_raw_len(&cl->hdrbuf.data), false);
-		if (!cl->pending_msg)
-			goto disconnect;
-
-		memcpy(&cl->pending_msg->hdr, &cl->hdrbuf.hdr, sizeof(cl->hdrbuf.hdr));
-		memcpy(cl->pending_msg->data, &cl->hdrbuf.data, sizeof(cl->hdrbuf.data));
-	}
+		bytes = ubusd_socket_recv(cl, need - cl->rx_len);
+		if (bytes < 0 && errno == EINTR)
+			continue;
 
-	ub = cl->pending_msg;
-	if (ub) {
-		int offset = cl->pending_msg_offset - sizeof(ub->hdr);
-		int len = blob_attr_raw_len(ub->data) - offset;
-		int bytes = 0;
+		if (bytes == 0)
+			sock->eof = true;
 
-		if (len > 0) {
-			bytes = read(sock->fd, (char *) ub->data + offset, len);
-			if (bytes <= 0)
-				goto out;
-		}
-
-		if (bytes < len) {
-			cl->pending_msg_offset += bytes;
-			goto out;
-		}
-
-		/* accept message */
-		ub->fd = cl->pending_msg_fd;
-		cl->pending_msg_fd = -1;
-		cl->pending_msg_offset = 0;
-		cl->pending_msg = NULL;
-		if(cl->on_message){
-			cl->on_message(cl, ub); 
-			//ubusd_proto_receive_message(cl, ub);
-		}
-		goto retry;
+		if (bytes <= 0)
+			break;
 	}
 
-out:
 	if (!sock->eof || ubusd_msg_head(cl))
 		return;
 
@@ -0,0 +1,12 @@
+#ifndef __UBUSD_SOCKET_H
+#define __UBUSD_SOCKET_H
+
+struct ubusd_client;
+struct ubusd_msg_buf;
+
+void ubusd_socket_init(struct ubusd_client *self, int fd);
+void ubusd_socket_destroy(struct ubusd_client *self);
+void ubusd_socket_on_message(struct ubusd_client *self, void (*cb)(struct ubusd_client *self, struct ubusd_msg_buf *ub));
+void ubusd_socket_on_disconnect(struct ubusd_client *self, void (*cb)(struct ubusd_client *self));
+
+#endif